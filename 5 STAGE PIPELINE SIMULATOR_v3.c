@@ -1,17 +1,90 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
 
 #define MAX_LEN 64
 #define REG_COUNT 32
 #define IMEM_SIZE 256
 #define DMEM_SIZE 256
-int stall = 0;
-int pc_redirect = 0;
-int pc_next = 0;
-int mem_forward_valid = 0;
-int mem_forward_rd = 0;
-int mem_forward_data = 0;
+#define DMEM_PAGE_WORDS 16
+#define DMEM_PAGES ((DMEM_SIZE + DMEM_PAGE_WORDS - 1) / DMEM_PAGE_WORDS)
+#define DUMP_MAGIC "RVDM"
+#define DUMP_VERSION 1
+#define CKPT_MAGIC "RVCK"
+#define CKPT_VERSION 8
+#define BBV_DIMS 15 // random projection width used for clustering
+#define KMEANS_ITERS 100
+#define PATH_LEN 512
+#define REGRESS_MAX_TESTS 256
+#define REGRESS_RESULT_LEN 8192
+#define REGRESS_MAX_CYCLES 100000
+#define GOLDEN_EXT ".golden"
+#define VARIANTS_FILE "regress.variants"
+#define REGRESS_MAX_VARIANTS 16
+#define MAX_FETCH_STAGES 8
+#define MAX_MEM_STAGES 8
+#define MAX_LOAD_USE 16
+#define SWEEP_MAX_PARAMS 16
+#define SWEEP_MAX_VALUES 32
+#define SWEEP_MAX_CYCLES 10000000
+
+// All simulator state is per thread so the regression runner can run programs in parallel.
+#define SIM_LOCAL _Thread_local
+
+SIM_LOCAL int stall = 0;
+SIM_LOCAL int pc_redirect = 0;
+SIM_LOCAL int pc_next = 0;
+SIM_LOCAL int mem_forward_data = 0;
+SIM_LOCAL int trace = 1; // cycle-by-cycle console output
+SIM_LOCAL int ckpt_report = 1; // print a line for each checkpoint saved or restored
+SIM_LOCAL const char *sim_fault = NULL; // set when the program makes an illegal access
+SIM_LOCAL int sim_fault_addr = 0;
+#define TRACE(...)                \
+    do                            \
+    {                             \
+        if (trace)                \
+            printf(__VA_ARGS__);  \
+    } while (0)
+
+///////////////////////////////////////////////////////// SIMULATOR OPTIONS /////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef enum
+{
+    DUMP_TEXT,
+    DUMP_BINARY
+} dump_format_t;
+
+typedef struct
+{
+    dump_format_t dump_format;
+    int dump_every;              // cycles between incremental dumps (0 = dump once at the end)
+    int save_at_cycle;           // checkpoint after this cycle (-1 = never)
+    int save_at_pc;              // checkpoint once this PC is fetched (-1 = never)
+    const char *checkpoint_file; // NULL = ckpt_<program>.bin
+    const char *restore_file;    // resume from this checkpoint instead of cycle 0
+    int max_cycles;              // stop the pipeline after this many cycles (0 = no limit)
+    long long max_instrs;        // functional execution limit for profiling
+    int bbv_interval;            // instructions per basic-block-vector interval
+    int simpoint_k;              // clusters for sampled simulation (0 = full simulation)
+    int simpoint_warmup;         // detailed warm-up instructions before each interval
+    int simpoint_verify;         // also run the full detailed simulation and report the real error
+    int cosim;                   // check every retired instruction against the functional model
+    int ecall_cost;              // cycles the pipeline is held while the host services an ecall
+    int clock_mhz;               // modelled clock rate for time syscalls
+    int fetch_stages;            // IF stages before ID (1..MAX_FETCH_STAGES)
+    int mem_stages;              // memory stages between EX and WB (1..MAX_MEM_STAGES)
+    int branch_in_id;            // resolve branches and jumps in ID instead of EX
+    int load_use;                // bubbles between a load and a dependent instruction (0..MAX_LOAD_USE, -1 = mem_stages)
+} sim_config_t;
+
+SIM_LOCAL sim_config_t cfg = {.dump_format = DUMP_TEXT, .save_at_cycle = -1, .save_at_pc = -1, .max_instrs = 100000000, .simpoint_warmup = 100, .ecall_cost = 100, .clock_mhz = 100,
+                              .fetch_stages = 1, .mem_stages = 1, .load_use = -1};
 
 ///////////////////////////////////////////////////////// OPCODES ///////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -54,6 +127,13 @@ typedef enum
     OP_AUIPC,
     OP_JAL,
     OP_JALR,
+    OP_CSRRW,
+    OP_CSRRS,
+    OP_CSRRC,
+    OP_CSRRWI,
+    OP_CSRRSI,
+    OP_CSRRCI,
+    OP_ECALL,
     OP_HALT,
     OP_NOP
 } opcode_t;
@@ -148,712 +228,3248 @@ control_t control(opcode_t op)
     return c;
 }
 
-/////////////////////////////////////////////////////////// PIPELINE REGISTERS ////////////////////////////////////////////////////////////////////////////////////
-
-typedef struct
-{
-    int valid, pc;
-    char instr[MAX_LEN];
-} IF_ID_t;
-typedef struct
-{
-    int valid, pc, rs1, rs2, rd, imm, v1, v2;
-    opcode_t op;
-    control_t ctrl;
-} ID_EX_t;
-typedef struct
-{
-    int valid, alu, rd, store_val;
-    opcode_t op;
-    control_t ctrl;
-} EX_MEM_t;
-typedef struct
+int is_csr_op(opcode_t op)
 {
-    int valid, alu, mem_data, rd;
-    opcode_t op;
-    control_t ctrl;
-} MEM_WB_t;
+    return op >= OP_CSRRW && op <= OP_CSRRCI;
+}
 
-///////////////////////////////////////////////////// GLOBAL STATE //////////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////// CONTROL AND STATUS REGISTERS ////////////////////////////////////////////////////////////////////////////////
+/*
+ * Counter CSRs. Slot 0 is mcycle, 1 is unused (time is derived from mcycle),
+ * 2 is minstret and 3-31 are the hpmcounters, each counting the event
+ * selected by its mhpmevent register. Counters are 64 bits; the *h CSRs
+ * expose the upper halves. Only the detailed pipeline advances them.
+ */
+#define CSR_CYCLE 0xC00
+#define CSR_TIME 0xC01
+#define CSR_INSTRET 0xC02
+#define CSR_MCYCLE 0xB00
+#define CSR_MINSTRET 0xB02
+#define CSR_MCOUNTINHIBIT 0x320
+#define CSR_MHPMEVENT 0x320 // mhpmevent3 is 0x323
 
-int reg_file[REG_COUNT], data_memory[DMEM_SIZE], pc = 0, cycle = 0, halt_fetched = 0, halt_done = 0;
-char instruction_memory[IMEM_SIZE][MAX_LEN];
-IF_ID_t IF_ID = {0};
-ID_EX_t ID_EX_old = {0}, ID_EX_new = {0};
-EX_MEM_t EX_MEM_old = {0}, EX_MEM_new = {0};
-MEM_WB_t MEM_WB_old = {0}, MEM_WB_new = {0};
+typedef enum
+{
+    HPM_NONE,
+    HPM_LOAD_USE_STALL,  // cycles the ID stage holds a load consumer
+    HPM_FLUSH,           // taken branches and jumps that redirect fetch
+    HPM_LOAD,            // loads retired
+    HPM_STORE,           // stores retired
+    HPM_BRANCH,          // conditional branches retired
+    HPM_ECALL_CYCLE,     // cycles the pipeline is held for a system call
+    HPM_SERIALIZE_STALL, // cycles ID waits for an ecall or CSR access to retire
+    HPM_BRANCH_STALL,    // cycles an early (ID) branch waits for an ALU operand
+    HPM_EVENT_COUNT
+} hpm_event_t;
+
+const char *hpm_event_names[HPM_EVENT_COUNT] = {"none", "load_use_stalls", "flushes", "loads", "stores",
+                                                "branches", "ecall_cycles", "serialize_stalls", "branch_stalls"};
+
+SIM_LOCAL unsigned long long csr_counter[32];
+SIM_LOCAL int csr_event[32];
+SIM_LOCAL int csr_inhibit;
+SIM_LOCAL unsigned long long hpm_totals[HPM_EVENT_COUNT]; // every event, counted by the host
+
+void hpm_count(hpm_event_t ev)
+{
+    hpm_totals[ev]++;
+    for (int i = 3; i < 32; i++)
+    {
+        if (csr_event[i] == (int)ev && !(csr_inhibit >> i & 1))
+            csr_counter[i]++;
+    }
+}
 
-/////////////////////////////////////////////////////////////////// Pipeline stages ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////// IF STAGE ///////////////////////////////////////////////////////
-void IF_stage(int instr_count)
+void csr_reset()
 {
+    memset(csr_counter, 0, sizeof(csr_counter));
+    memset(csr_event, 0, sizeof(csr_event));
+    memset(hpm_totals, 0, sizeof(hpm_totals));
+    csr_inhibit = 0;
+}
 
-    if (stall)
+// Returns 0 if the CSR does not exist.
+int csr_read(int csr, int *val)
+{
+    int base = csr & ~0x1F, idx = csr & 0x1F;
+    if (base == CSR_CYCLE || base == CSR_CYCLE + 0x80 || base == CSR_MCYCLE || base == CSR_MCYCLE + 0x80)
     {
-        printf("IF  : STALL (PC frozen)\n");
-        return;
+        if (idx == 1 && base < CSR_CYCLE)
+            return 0;
+        unsigned long long v = idx == 1 ? csr_counter[0] / cfg.clock_mhz : csr_counter[idx];
+        *val = (int)(base & 0x80 ? v >> 32 : v);
+        return 1;
     }
-
-    if (pc_redirect)
+    if (csr == CSR_MCOUNTINHIBIT)
     {
-        pc = pc_next;
-        pc_redirect = 0;
+        *val = csr_inhibit;
+        return 1;
     }
+    if (csr >= CSR_MHPMEVENT + 3 && csr < CSR_MHPMEVENT + 32)
+    {
+        *val = csr_event[csr - CSR_MHPMEVENT];
+        return 1;
+    }
+    return 0;
+}
 
-    if (halt_fetched || (pc / 4) >= instr_count)
+// Returns 0 if the CSR does not exist or is read-only.
+int csr_write(int csr, int val)
+{
+    int base = csr & ~0x1F, idx = csr & 0x1F;
+    if ((base == CSR_MCYCLE || base == CSR_MCYCLE + 0x80) && idx != 1)
     {
-        IF_ID.valid = 0;
-        return;
+        unsigned long long v = csr_counter[idx];
+        if (base & 0x80)
+            csr_counter[idx] = (v & 0xFFFFFFFFull) | (unsigned long long)(unsigned int)val << 32;
+        else
+            csr_counter[idx] = (v & ~0xFFFFFFFFull) | (unsigned int)val;
+        return 1;
+    }
+    if (csr == CSR_MCOUNTINHIBIT)
+    {
+        csr_inhibit = val & ~2;
+        return 1;
     }
+    if (csr >= CSR_MHPMEVENT + 3 && csr < CSR_MHPMEVENT + 32)
+    {
+        csr_event[csr - CSR_MHPMEVENT] = val;
+        return 1;
+    }
+    return 0;
+}
 
-    IF_ID.valid = 1;
-    IF_ID.pc = pc;
-    strcpy(IF_ID.instr, instruction_memory[pc / 4]);
+/*
+ * Executes a Zicsr instruction on regs. src is rs1 for the register forms
+ * and the 5-bit immediate for the others. rs1/uimm = 0 suppresses the write of
+ * csrrs/csrrc. Returns 0 on an illegal access (regs untouched), 2 if the CSR
+ * was written and 1 otherwise.
+ */
+int csr_execute(opcode_t op, int rd, int src, int csr, int *regs)
+{
+    int old, val = op >= OP_CSRRWI ? src : regs[src];
+    int writes = op == OP_CSRRW || op == OP_CSRRWI || src != 0;
+    if (!csr_read(csr, &old))
+        return 0;
 
-    if (!strcmp(IF_ID.instr, "halt"))
-        halt_fetched = 1;
+    if (op == OP_CSRRS || op == OP_CSRRSI)
+        val = old | val;
+    else if (op == OP_CSRRC || op == OP_CSRRCI)
+        val = old & ~val;
+    if (writes && !csr_write(csr, val))
+        return 0;
 
-    pc += 4;
+    if (rd != 0)
+        regs[rd] = old;
+    return writes ? 2 : 1;
 }
 
-////////////////////////////////////////////////////////////////// ID STAGE ////////////////////////////////////////////////////////////////////////////////////////////
+// Maps a CSR name (or number) to its address; -1 if unknown.
+int csr_number(const char *name)
+{
+    static const struct
+    {
+        const char *name;
+        int csr;
+    } named[] = {
+        {"cycle", CSR_CYCLE}, {"time", CSR_TIME}, {"instret", CSR_INSTRET},
+        {"cycleh", CSR_CYCLE + 0x80}, {"timeh", CSR_TIME + 0x80}, {"instreth", CSR_INSTRET + 0x80},
+        {"mcycle", CSR_MCYCLE}, {"minstret", CSR_MINSTRET},
+        {"mcycleh", CSR_MCYCLE + 0x80}, {"minstreth", CSR_MINSTRET + 0x80},
+        {"mcountinhibit", CSR_MCOUNTINHIBIT}};
+    for (size_t i = 0; i < sizeof(named) / sizeof(named[0]); i++)
+    {
+        if (!strcmp(name, named[i].name))
+            return named[i].csr;
+    }
+
+    int n, end = 0;
+    char high = 0;
+    if (sscanf(name, "hpmcounter%d%c%n", &n, &high, &end) >= 1 && n >= 3 && n < 32)
+        return (high == 'h' && !name[end] ? CSR_CYCLE + 0x80 : high ? -1 : CSR_CYCLE) + n;
+    if (sscanf(name, "mhpmcounter%d%c%n", &n, &high, &end) >= 1 && n >= 3 && n < 32)
+        return (high == 'h' && !name[end] ? CSR_MCYCLE + 0x80 : high ? -1 : CSR_MCYCLE) + n;
+    if (sscanf(name, "mhpmevent%d%n", &n, &end) == 1 && n >= 3 && n < 32 && !name[end])
+        return CSR_MHPMEVENT + n;
+
+    char *rest;
+    long v = strtol(name, &rest, 0);
+    return (rest != name && !*rest && v >= 0 && v < 0x1000) ? (int)v : -1;
+}
 
-void ID_stage()
+////////////////////////////////////////////////////////////// DECODER ////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
 {
-    if (stall)
-    {
-        ID_EX_new.valid = 0;
-        return;
-    }
-    if (!IF_ID.valid)
+    opcode_t op;
+    int rd, rs1, rs2, imm;
+} decoded_t;
+
+// Parses one assembly line; unrecognised mnemonics decode as OP_NOP.
+decoded_t decode(const char *line)
+{
+    decoded_t d = {0};
+
+    // Drop blanks after commas so "add x1, x2, x3" parses like "add x1,x2,x3".
+    char instr[MAX_LEN];
+    int len = 0;
+    for (const char *c = line; *c && len < MAX_LEN - 1; c++)
     {
-        ID_EX_new.valid = 0;
-        return;
+        if ((*c == ' ' || *c == '\t') && len && instr[len - 1] == ',')
+            continue;
+        instr[len++] = *c;
     }
+    instr[len] = 0;
 
-    ID_EX_new = (ID_EX_t){0};
-    ID_EX_new.valid = 1;
-    ID_EX_new.pc = IF_ID.pc;
-
-    char op[16];
-    sscanf(IF_ID.instr, "%s", op);
+    char op[16] = "", csr[32] = "";
+    sscanf(instr, "%15s", op);
 
     // --- R-TYPE: instr rd, rs1, rs2 ---
     if (!strcmp(op, "add"))
     {
-        ID_EX_new.op = OP_ADD;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,x%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.rs2);
+        d.op = OP_ADD;
+        sscanf(instr, "%*s x%d,x%d,x%d", &d.rd, &d.rs1, &d.rs2);
     }
     else if (!strcmp(op, "sub"))
     {
-        ID_EX_new.op = OP_SUB;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,x%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.rs2);
+        d.op = OP_SUB;
+        sscanf(instr, "%*s x%d,x%d,x%d", &d.rd, &d.rs1, &d.rs2);
     }
     else if (!strcmp(op, "sll"))
     {
-        ID_EX_new.op = OP_SLL;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,x%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.rs2);
+        d.op = OP_SLL;
+        sscanf(instr, "%*s x%d,x%d,x%d", &d.rd, &d.rs1, &d.rs2);
     }
     else if (!strcmp(op, "srl"))
     {
-        ID_EX_new.op = OP_SRL;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,x%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.rs2);
+        d.op = OP_SRL;
+        sscanf(instr, "%*s x%d,x%d,x%d", &d.rd, &d.rs1, &d.rs2);
     }
     else if (!strcmp(op, "sra"))
     {
-        ID_EX_new.op = OP_SRA;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,x%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.rs2);
+        d.op = OP_SRA;
+        sscanf(instr, "%*s x%d,x%d,x%d", &d.rd, &d.rs1, &d.rs2);
     }
     else if (!strcmp(op, "xor"))
     {
-        ID_EX_new.op = OP_XOR;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,x%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.rs2);
+        d.op = OP_XOR;
+        sscanf(instr, "%*s x%d,x%d,x%d", &d.rd, &d.rs1, &d.rs2);
     }
     else if (!strcmp(op, "or"))
     {
-        ID_EX_new.op = OP_OR;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,x%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.rs2);
+        d.op = OP_OR;
+        sscanf(instr, "%*s x%d,x%d,x%d", &d.rd, &d.rs1, &d.rs2);
     }
     else if (!strcmp(op, "and"))
     {
-        ID_EX_new.op = OP_AND;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,x%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.rs2);
+        d.op = OP_AND;
+        sscanf(instr, "%*s x%d,x%d,x%d", &d.rd, &d.rs1, &d.rs2);
+    }
+    else if (!strcmp(op, "slt"))
+    {
+        d.op = OP_SLT;
+        sscanf(instr, "%*s x%d,x%d,x%d", &d.rd, &d.rs1, &d.rs2);
+    }
+    else if (!strcmp(op, "sltu"))
+    {
+        d.op = OP_SLTU;
+        sscanf(instr, "%*s x%d,x%d,x%d", &d.rd, &d.rs1, &d.rs2);
     }
 
     // --- I-TYPE (ALU): instr rd, rs1, imm ---
     else if (!strcmp(op, "addi"))
     {
-        ID_EX_new.op = OP_ADDI;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.imm);
+        d.op = OP_ADDI;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rd, &d.rs1, &d.imm);
     }
     else if (!strcmp(op, "slli"))
     {
-        ID_EX_new.op = OP_SLLI;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.imm);
+        d.op = OP_SLLI;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rd, &d.rs1, &d.imm);
     }
     else if (!strcmp(op, "srli"))
     {
-        ID_EX_new.op = OP_SRLI;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.imm);
+        d.op = OP_SRLI;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rd, &d.rs1, &d.imm);
     }
     else if (!strcmp(op, "srai"))
     {
-        ID_EX_new.op = OP_SRAI;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.imm);
+        d.op = OP_SRAI;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rd, &d.rs1, &d.imm);
+    }
+    else if (!strcmp(op, "slti"))
+    {
+        d.op = OP_SLTI;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rd, &d.rs1, &d.imm);
+    }
+    else if (!strcmp(op, "sltiu"))
+    {
+        d.op = OP_SLTIU;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rd, &d.rs1, &d.imm);
+    }
+    else if (!strcmp(op, "xori"))
+    {
+        d.op = OP_XORI;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rd, &d.rs1, &d.imm);
+    }
+    else if (!strcmp(op, "ori"))
+    {
+        d.op = OP_ORI;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rd, &d.rs1, &d.imm);
+    }
+    else if (!strcmp(op, "andi"))
+    {
+        d.op = OP_ANDI;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rd, &d.rs1, &d.imm);
     }
 
     // --- I-TYPE (LOADS): instr rd, imm(rs1) ---
     else if (!strcmp(op, "lw"))
     {
-        ID_EX_new.op = OP_LW;
-        sscanf(IF_ID.instr, "%*s x%d,%d(x%d)", &ID_EX_new.rd, &ID_EX_new.imm, &ID_EX_new.rs1);
+        d.op = OP_LW;
+        sscanf(instr, "%*s x%d,%d(x%d)", &d.rd, &d.imm, &d.rs1);
     }
     else if (!strcmp(op, "lb"))
     {
-        ID_EX_new.op = OP_LB;
-        sscanf(IF_ID.instr, "%*s x%d,%d(x%d)", &ID_EX_new.rd, &ID_EX_new.imm, &ID_EX_new.rs1);
+        d.op = OP_LB;
+        sscanf(instr, "%*s x%d,%d(x%d)", &d.rd, &d.imm, &d.rs1);
     }
     else if (!strcmp(op, "lh"))
     {
-        ID_EX_new.op = OP_LH;
-        sscanf(IF_ID.instr, "%*s x%d,%d(x%d)", &ID_EX_new.rd, &ID_EX_new.imm, &ID_EX_new.rs1);
+        d.op = OP_LH;
+        sscanf(instr, "%*s x%d,%d(x%d)", &d.rd, &d.imm, &d.rs1);
+    }
+    else if (!strcmp(op, "lbu"))
+    {
+        d.op = OP_LBU;
+        sscanf(instr, "%*s x%d,%d(x%d)", &d.rd, &d.imm, &d.rs1);
+    }
+    else if (!strcmp(op, "lhu"))
+    {
+        d.op = OP_LHU;
+        sscanf(instr, "%*s x%d,%d(x%d)", &d.rd, &d.imm, &d.rs1);
     }
 
     // --- S-TYPE (STORES): instr rs2, imm(rs1) ---
     else if (!strcmp(op, "sw"))
     {
-        ID_EX_new.op = OP_SW;
-        sscanf(IF_ID.instr, "%*s x%d,%d(x%d)", &ID_EX_new.rs2, &ID_EX_new.imm, &ID_EX_new.rs1);
+        d.op = OP_SW;
+        sscanf(instr, "%*s x%d,%d(x%d)", &d.rs2, &d.imm, &d.rs1);
     }
     else if (!strcmp(op, "sb"))
     {
-        ID_EX_new.op = OP_SB;
-        sscanf(IF_ID.instr, "%*s x%d,%d(x%d)", &ID_EX_new.rs2, &ID_EX_new.imm, &ID_EX_new.rs1);
+        d.op = OP_SB;
+        sscanf(instr, "%*s x%d,%d(x%d)", &d.rs2, &d.imm, &d.rs1);
+    }
+    else if (!strcmp(op, "sh"))
+    {
+        d.op = OP_SH;
+        sscanf(instr, "%*s x%d,%d(x%d)", &d.rs2, &d.imm, &d.rs1);
     }
 
     // --- B-TYPE (BRANCHES): instr rs1, rs2, imm ---
     else if (!strcmp(op, "beq"))
     {
-        ID_EX_new.op = OP_BEQ;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,%d", &ID_EX_new.rs1, &ID_EX_new.rs2, &ID_EX_new.imm);
+        d.op = OP_BEQ;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rs1, &d.rs2, &d.imm);
     }
     else if (!strcmp(op, "bne"))
     {
-        ID_EX_new.op = OP_BNE;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,%d", &ID_EX_new.rs1, &ID_EX_new.rs2, &ID_EX_new.imm);
+        d.op = OP_BNE;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rs1, &d.rs2, &d.imm);
     }
     else if (!strcmp(op, "blt"))
     {
-        ID_EX_new.op = OP_BLT;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,%d", &ID_EX_new.rs1, &ID_EX_new.rs2, &ID_EX_new.imm);
+        d.op = OP_BLT;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rs1, &d.rs2, &d.imm);
     }
     else if (!strcmp(op, "bge"))
     {
-        ID_EX_new.op = OP_BGE;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,%d", &ID_EX_new.rs1, &ID_EX_new.rs2, &ID_EX_new.imm);
+        d.op = OP_BGE;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rs1, &d.rs2, &d.imm);
+    }
+    else if (!strcmp(op, "bltu"))
+    {
+        d.op = OP_BLTU;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rs1, &d.rs2, &d.imm);
+    }
+    else if (!strcmp(op, "bgeu"))
+    {
+        d.op = OP_BGEU;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rs1, &d.rs2, &d.imm);
     }
 
     // --- U-TYPE & J-TYPE ---
     else if (!strcmp(op, "lui"))
     {
-        ID_EX_new.op = OP_LUI;
-        sscanf(IF_ID.instr, "%*s x%d,%d", &ID_EX_new.rd, &ID_EX_new.imm);
+        d.op = OP_LUI;
+        sscanf(instr, "%*s x%d,%d", &d.rd, &d.imm);
     }
     else if (!strcmp(op, "auipc"))
     {
-        ID_EX_new.op = OP_AUIPC;
-        sscanf(IF_ID.instr, "%*s x%d,%d", &ID_EX_new.rd, &ID_EX_new.imm);
+        d.op = OP_AUIPC;
+        sscanf(instr, "%*s x%d,%d", &d.rd, &d.imm);
     }
     else if (!strcmp(op, "jal"))
     {
-        ID_EX_new.op = OP_JAL;
-        sscanf(IF_ID.instr, "%*s x%d,%d", &ID_EX_new.rd, &ID_EX_new.imm);
+        d.op = OP_JAL;
+        sscanf(instr, "%*s x%d,%d", &d.rd, &d.imm);
     }
     else if (!strcmp(op, "jalr"))
     {
-        ID_EX_new.op = OP_JALR;
-        sscanf(IF_ID.instr, "%*s x%d,x%d,%d", &ID_EX_new.rd, &ID_EX_new.rs1, &ID_EX_new.imm);
+        d.op = OP_JALR;
+        sscanf(instr, "%*s x%d,x%d,%d", &d.rd, &d.rs1, &d.imm);
+    }
+
+    // --- ZICSR: instr rd, csr, rs1|uimm (csr by name or number, kept in imm) ---
+    else if (!strcmp(op, "csrrw") || !strcmp(op, "csrrs") || !strcmp(op, "csrrc"))
+    {
+        d.op = op[4] == 'w' ? OP_CSRRW : op[4] == 's' ? OP_CSRRS : OP_CSRRC;
+        sscanf(instr, "%*s x%d,%31[^,],x%d", &d.rd, csr, &d.rs1);
+        d.imm = csr_number(csr);
+    }
+    else if (!strcmp(op, "csrrwi") || !strcmp(op, "csrrsi") || !strcmp(op, "csrrci"))
+    {
+        d.op = op[4] == 'w' ? OP_CSRRWI : op[4] == 's' ? OP_CSRRSI : OP_CSRRCI;
+        sscanf(instr, "%*s x%d,%31[^,],%d", &d.rd, csr, &d.rs1);
+        d.rs1 &= 0x1F;
+        d.imm = csr_number(csr);
+    }
+    else if (!strcmp(op, "csrr"))
+    {
+        d.op = OP_CSRRS;
+        sscanf(instr, "%*s x%d,%31s", &d.rd, csr);
+        d.imm = csr_number(csr);
+    }
+    else if (!strcmp(op, "csrw"))
+    {
+        d.op = OP_CSRRW;
+        sscanf(instr, "%*s %31[^,],x%d", csr, &d.rs1);
+        d.imm = csr_number(csr);
+    }
+    else if (!strcmp(op, "rdcycle") || !strcmp(op, "rdtime") || !strcmp(op, "rdinstret"))
+    {
+        d.op = OP_CSRRS;
+        sscanf(instr, "%*s x%d", &d.rd);
+        d.imm = op[2] == 'c' ? CSR_CYCLE : op[2] == 't' ? CSR_TIME : CSR_INSTRET;
+    }
+
+    else if (!strcmp(op, "ecall"))
+    {
+        d.op = OP_ECALL;
     }
 
     else if (!strcmp(op, "halt"))
     {
-        ID_EX_new.op = OP_HALT;
-        ID_EX_new.ctrl = (control_t){0};
+        d.op = OP_HALT;
     }
 
     else
     {
-        ID_EX_new.op = OP_NOP;
+        d.op = OP_NOP;
     }
 
-    stall = 0;
+    return d;
+}
 
-    static int load_stall = 0;
+/////////////////////////////////////////////////////////// PIPELINE REGISTERS ////////////////////////////////////////////////////////////////////////////////////
 
-    if (load_stall)
-    {
-        load_stall = 0;
-        stall = 1;
-        ID_EX_new.valid = 0;
-        return;
-    }
+typedef struct
+{
+    int valid, pc;
+    char instr[MAX_LEN];
+} IF_ID_t;
+typedef struct
+{
+    int valid, pc, rs1, rs2, rd, imm;
+    opcode_t op;
+    control_t ctrl;
+} ID_EX_t;
+typedef struct
+{
+    int valid, pc, alu, rd, store_val;
+    opcode_t op;
+    control_t ctrl;
+} EX_MEM_t;
+typedef struct
+{
+    int valid, pc, alu, mem_data, rd, store_val;
+    opcode_t op;
+    control_t ctrl;
+} MEM_WB_t;
 
-    if (ID_EX_old.valid && ID_EX_old.ctrl.MemRead)
-    {
-        if (ID_EX_old.rd != 0 &&
-            (ID_EX_old.rd == ID_EX_new.rs1 ||
-             ID_EX_old.rd == ID_EX_new.rs2))
-        {
+///////////////////////////////////////////////////// GLOBAL STATE //////////////////////////////////////////////////////////////////////////////////////////////
 
-            stall = 1;
-            ID_EX_new.valid = 0;
-            return;
-        }
-    }
+SIM_LOCAL int reg_file[REG_COUNT], data_memory[DMEM_SIZE], pc = 0, cycle = 0, halt_fetched = 0, halt_done = 0;
+SIM_LOCAL long long instret = 0; // instructions retired in WB
+SIM_LOCAL char program_text[IMEM_SIZE][MAX_LEN];
+SIM_LOCAL decoded_t program_table[IMEM_SIZE];
+// The program in use: normally the two arrays above, in a sweep one shared read-only copy.
+SIM_LOCAL char (*instruction_memory)[MAX_LEN];
+SIM_LOCAL decoded_t *program_decoded;
+SIM_LOCAL unsigned char dmem_dirty[DMEM_PAGES]; // pages written since the last dump
+SIM_LOCAL int dump_frames = 0;
+SIM_LOCAL IF_ID_t IF_ID = {0};
+SIM_LOCAL ID_EX_t ID_EX_old = {0}, ID_EX_new = {0};
+SIM_LOCAL EX_MEM_t EX_MEM_old = {0}, EX_MEM_new = {0};
+SIM_LOCAL MEM_WB_t MEM_WB_old = {0}, MEM_WB_new = {0};
+SIM_LOCAL IF_ID_t fetch_pipe[MAX_FETCH_STAGES - 1];                                   // fetch stages ahead of IF/ID, newest first
+SIM_LOCAL MEM_WB_t mem_pipe_old[MAX_MEM_STAGES - 1], mem_pipe_new[MAX_MEM_STAGES - 1]; // memory stages 2..n
+SIM_LOCAL MEM_WB_t retired_pipe[MAX_LOAD_USE];                                        // already written back, newest first
+
+///////////////////////////////////////////////////////////// BASIC BLOCK VECTORS //////////////////////////////////////////////////////////////////////////////////////
+/*
+ * Basic blocks are identified by their leader: the first instruction retired
+ * after a non-sequential PC. Each retired instruction is charged to the current
+ * leader, so wrong-path fetches never count and the pipeline profile matches
+ * the functional one; every bbv_interval instructions the counts are normalised, reduced to
+ * BBV_DIMS dimensions by a fixed random projection and stored for clustering.
+ */
+SIM_LOCAL int bbv_interval = 0;      // instructions per interval (0 = profiling off)
+SIM_LOCAL FILE *bbv_file = NULL;     // optional SimPoint-style .bb output
+SIM_LOCAL int bbv_counts[IMEM_SIZE]; // instructions per block leader in the current interval
+SIM_LOCAL int bbv_leader = -1, bbv_last_pc = 0, bbv_len = 0;
+SIM_LOCAL double bbv_projection[IMEM_SIZE][BBV_DIMS];
+SIM_LOCAL double *bbv_points = NULL; // BBV_DIMS projected values per interval
+SIM_LOCAL int *bbv_lengths = NULL;   // instructions in each interval
+SIM_LOCAL int bbv_count = 0, bbv_capacity = 0;
+
+unsigned int xorshift32(unsigned int *state)
+{
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
 
-    ID_EX_new.ctrl = control(ID_EX_new.op);
-    ID_EX_new.v1 = reg_file[ID_EX_new.rs1];
-    ID_EX_new.v2 = reg_file[ID_EX_new.rs2];
+void bbv_begin(int interval, FILE *out)
+{
+    unsigned int seed = 0x5EED;
+    for (int b = 0; b < IMEM_SIZE; b++)
+        for (int d = 0; d < BBV_DIMS; d++)
+            bbv_projection[b][d] = xorshift32(&seed) / 2147483648.0 - 1.0;
+
+    memset(bbv_counts, 0, sizeof(bbv_counts));
+    bbv_interval = interval;
+    bbv_file = out;
+    bbv_leader = -1;
+    bbv_len = 0;
+    bbv_count = 0;
 }
-//////////////////////////////////////////////////// FORWARDING UNIT /////////////////////////////////////////////////////////////////////////////////////////////////
 
-int forward_ex(int rs, int val)
+void bbv_close_interval()
 {
-    if (rs == 0)
-        return 0;
+    if (!bbv_len)
+        return;
 
-    // EX/MEM forwarding (ALU ops only)
-    if (EX_MEM_old.valid &&
-        EX_MEM_old.ctrl.RegWrite &&
-        !EX_MEM_old.ctrl.MemRead &&
-        EX_MEM_old.rd == rs)
+    if (bbv_count == bbv_capacity)
     {
-        return EX_MEM_old.alu;
+        bbv_capacity = bbv_capacity ? bbv_capacity * 2 : 64;
+        bbv_points = realloc(bbv_points, bbv_capacity * BBV_DIMS * sizeof(double));
+        bbv_lengths = realloc(bbv_lengths, bbv_capacity * sizeof(int));
     }
 
-    // MEM → EX forwarding (LOAD result from SAME cycle)
-    if (MEM_WB_new.valid &&
-        MEM_WB_new.ctrl.RegWrite &&
-        MEM_WB_new.ctrl.MemToReg &&
-        MEM_WB_new.rd == rs)
-    {
-        return MEM_WB_new.mem_data;
-    }
+    double *point = &bbv_points[bbv_count * BBV_DIMS];
+    memset(point, 0, BBV_DIMS * sizeof(double));
+    if (bbv_file)
+        fprintf(bbv_file, "T");
 
-    // MEM/WB forwarding (previous cycle)
-    if (MEM_WB_old.valid &&
-        MEM_WB_old.ctrl.RegWrite &&
-        MEM_WB_old.rd == rs)
+    for (int b = 0; b < IMEM_SIZE; b++)
     {
-        return MEM_WB_old.ctrl.MemToReg ? MEM_WB_old.mem_data : MEM_WB_old.alu;
+        if (!bbv_counts[b])
+            continue;
+        double weight = bbv_counts[b] / (double)bbv_len;
+        for (int d = 0; d < BBV_DIMS; d++)
+            point[d] += weight * bbv_projection[b][d];
+        if (bbv_file)
+            fprintf(bbv_file, ":%d:%d ", b + 1, bbv_counts[b]);
+        bbv_counts[b] = 0;
     }
+    if (bbv_file)
+        fprintf(bbv_file, "\n");
 
-    return val;
+    bbv_lengths[bbv_count++] = bbv_len;
+    bbv_len = 0;
 }
 
-////////////////////////////////////////////////////////////////////////////EX STAGE //////////////////////////////////////////////////////////////////////////////////////////
-void EX_stage()
+void bbv_retire(int retire_pc)
 {
-    if (!ID_EX_old.valid)
-    {
-        EX_MEM_new.valid = 0;
-        printf("EX  : BUBBLE\n");
-        return;
-    }
-
-    EX_MEM_new.valid = 1;
-    EX_MEM_new.op = ID_EX_old.op;
-    EX_MEM_new.ctrl = ID_EX_old.ctrl;
-    EX_MEM_new.rd = ID_EX_old.rd;
+    if (bbv_leader < 0 || retire_pc != bbv_last_pc + 4)
+        bbv_leader = retire_pc / 4;
+    bbv_last_pc = retire_pc;
+    bbv_counts[bbv_leader]++;
 
-    // --- FORWARDING LOGIC ---
-    int a = reg_file[ID_EX_old.rs1];
-    int b = ID_EX_old.ctrl.ALUSrc
-                ? ID_EX_old.imm
-                : reg_file[ID_EX_old.rs2];
+    if (++bbv_len == bbv_interval)
+        bbv_close_interval();
+}
 
-    /* forwarding AFTER rereading register file */
-    a = forward_ex(ID_EX_old.rs1, a);
-    if (!ID_EX_old.ctrl.ALUSrc)
-        b = forward_ex(ID_EX_old.rs2, b);
+// Flushes the partial last interval and stops profiling.
+void bbv_end()
+{
+    bbv_close_interval();
+    bbv_interval = 0;
+    if (bbv_file)
+        fclose(bbv_file);
+    bbv_file = NULL;
+}
 
-    /* MEM → EX forwarding for load */
-    if (mem_forward_valid && mem_forward_rd == ID_EX_old.rs1)
-        a = mem_forward_data;
+// Releases the stored intervals once they have been used.
+void bbv_free()
+{
+    free(bbv_points);
+    free(bbv_lengths);
+    bbv_points = NULL;
+    bbv_lengths = NULL;
+    bbv_count = bbv_capacity = 0;
+}
 
-    if (!ID_EX_old.ctrl.ALUSrc &&
-        mem_forward_valid && mem_forward_rd == ID_EX_old.rs2)
-        b = mem_forward_data;
+/////////////////////////////////////////////////////////////////// Pipeline stages ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////// IF STAGE ///////////////////////////////////////////////////////
+void IF_stage(int instr_count)
+{
 
-    /* existing forwarding */
-    a = forward_ex(ID_EX_old.rs1, a);
-    if (!ID_EX_old.ctrl.ALUSrc)
-        b = forward_ex(ID_EX_old.rs2, b);
+    if (stall)
+    {
+        TRACE("IF  : STALL (PC frozen)\n");
+        return;
+    }
 
-    int store_val = reg_file[ID_EX_old.rs2];
+    if (pc_redirect)
+    {
+        pc = pc_next;
+        pc_redirect = 0;
+    }
 
-    // EX/MEM forwarding
-    if (EX_MEM_old.valid &&
-        EX_MEM_old.ctrl.RegWrite &&
-        EX_MEM_old.rd == ID_EX_old.rs2)
+    IF_ID_t fetched = {0};
+    if (!halt_fetched && pc >= 0 && (pc / 4) < instr_count)
     {
-        store_val = EX_MEM_old.alu;
+        fetched.valid = 1;
+        fetched.pc = pc;
+        strcpy(fetched.instr, instruction_memory[pc / 4]);
+
+        if (!strcmp(fetched.instr, "halt"))
+            halt_fetched = 1;
+
+        pc += 4;
     }
 
-    // MEM/WB forwarding
-    if (MEM_WB_old.valid &&
-        MEM_WB_old.ctrl.RegWrite &&
-        MEM_WB_old.rd == ID_EX_old.rs2)
+    // With several fetch stages the oldest one moves into IF/ID.
+    int extra = cfg.fetch_stages - 1;
+    if (extra > 0)
+    {
+        IF_ID = fetch_pipe[extra - 1];
+        memmove(&fetch_pipe[1], &fetch_pipe[0], (extra - 1) * sizeof(IF_ID_t));
+        fetch_pipe[0] = fetched;
+    }
+    else
     {
-        store_val = MEM_WB_old.ctrl.MemToReg
-                        ? MEM_WB_old.mem_data
-                        : MEM_WB_old.alu;
+        IF_ID = fetched;
     }
+}
 
-    EX_MEM_new.store_val = store_val;
+// Squashes every fetched instruction that has not reached ID yet.
+void flush_fetch()
+{
+    IF_ID.valid = 0;
+    for (int i = 0; i < MAX_FETCH_STAGES - 1; i++)
+        fetch_pipe[i].valid = 0;
+    halt_fetched = 0; // a squashed halt was on the wrong path
+}
 
-    // --- ALU OPERATIONS ---
-    switch (ID_EX_old.op)
+// Most recently fetched instruction.
+const IF_ID_t *last_fetched()
+{
+    return cfg.fetch_stages > 1 ? &fetch_pipe[0] : &IF_ID;
+}
+
+////////////////////////////////////////////////////////////// DATAPATH ////////////////////////////////////////////////////////////////////////////////////////////////
+// Shared by the pipeline stages and the functional model.
+
+int alu_compute(opcode_t op, int a, int b, int imm, int pc)
+{
+    switch (op)
     {
     case OP_ADD:
     case OP_ADDI:
-        EX_MEM_new.alu = a + b;
-        break;
+        return a + b;
     case OP_SUB:
-        EX_MEM_new.alu = a - b;
-        break;
+        return a - b;
     case OP_AND:
     case OP_ANDI:
-        EX_MEM_new.alu = a & b;
-        break;
+        return a & b;
     case OP_OR:
     case OP_ORI:
-        EX_MEM_new.alu = a | b;
-        break;
+        return a | b;
     case OP_XOR:
     case OP_XORI:
-        EX_MEM_new.alu = a ^ b;
-        break;
+        return a ^ b;
     case OP_SLL:
     case OP_SLLI:
-        EX_MEM_new.alu = a << (b & 0x1F);
-        break;
+        return a << (b & 0x1F);
     case OP_SRL:
     case OP_SRLI:
-        EX_MEM_new.alu = (unsigned int)a >> (b & 0x1F);
-        break;
+        return (unsigned int)a >> (b & 0x1F);
     case OP_SRA:
     case OP_SRAI:
-        EX_MEM_new.alu = a >> (b & 0x1F);
-        break;
+        return a >> (b & 0x1F);
     case OP_SLT:
     case OP_SLTI:
-        EX_MEM_new.alu = (a < b) ? 1 : 0;
-        break;
+        return (a < b) ? 1 : 0;
     case OP_SLTU:
     case OP_SLTIU:
-        EX_MEM_new.alu = ((unsigned int)a < (unsigned int)b) ? 1 : 0;
-        break;
+        return ((unsigned int)a < (unsigned int)b) ? 1 : 0;
     case OP_LUI:
-        EX_MEM_new.alu = ID_EX_old.imm << 12;
-        break;
+        return imm << 12;
     case OP_AUIPC:
-        EX_MEM_new.alu = ID_EX_old.pc + (ID_EX_old.imm << 12);
-        break;
+        return pc + (imm << 12);
     case OP_JAL:
     case OP_JALR:
-        EX_MEM_new.alu = ID_EX_old.pc + 4;
-        break;
+        return pc + 4;
     case OP_BEQ:
     case OP_BNE:
     case OP_BLT:
     case OP_BGE:
     case OP_BLTU:
     case OP_BGEU:
-        EX_MEM_new.alu = 0;
-        break;
-        // Save return address
+        return 0;
     default:
-        EX_MEM_new.alu = a + b;
-        break;
-    }
-
-    // --- BRANCH AND JUMP HANDLING ---
-    int take_branch = 0;
-    if (ID_EX_old.ctrl.Branch)
-    {
-        switch (ID_EX_old.op)
-        {
-        case OP_BEQ:
-            take_branch = (a == b);
-            break;
-        case OP_BNE:
-            take_branch = (a != b);
-            break;
-        case OP_BLT:
-            take_branch = (a < b);
-            break;
-        case OP_BGE:
-            take_branch = (a >= b);
-            break;
-        case OP_BLTU:
-            take_branch = ((unsigned)a < (unsigned)b);
-            break;
-        case OP_BGEU:
-            take_branch = ((unsigned)a >= (unsigned)b);
-            break;
-
-        default:
-            break;
-        }
+        return a + b;
     }
+}
 
-    if (take_branch || ID_EX_old.op == OP_JAL || ID_EX_old.op == OP_JALR)
+int branch_taken(opcode_t op, int a, int b)
+{
+    switch (op)
     {
-        if (ID_EX_old.op == OP_JALR)
-            pc_next = (a + ID_EX_old.imm) & ~1;
-        else
-            pc_next = ID_EX_old.pc + (ID_EX_old.imm << 2);
+    case OP_BEQ:
+        return a == b;
+    case OP_BNE:
+        return a != b;
+    case OP_BLT:
+        return a < b;
+    case OP_BGE:
+        return a >= b;
+    case OP_BLTU:
+        return (unsigned)a < (unsigned)b;
+    case OP_BGEU:
+        return (unsigned)a >= (unsigned)b;
+    default:
+        return 0;
+    }
+}
+
+// Extracts and extends a loaded value from the addressed word.
+int load_extend(opcode_t op, int raw_word, int byte_offset)
+{
+    switch (op)
+    {
+    case OP_LB: // Load Byte (Signed)
+        return (signed char)((raw_word >> (byte_offset * 8)) & 0xFF);
+    case OP_LBU: // Load Byte (Unsigned)
+        return (unsigned char)((raw_word >> (byte_offset * 8)) & 0xFF);
+    case OP_LH: // Load Half (Signed)
+        return (signed short)((raw_word >> (byte_offset * 8)) & 0xFFFF);
+    case OP_LHU: // Load Half (Unsigned)
+        return (unsigned short)((raw_word >> (byte_offset * 8)) & 0xFFFF);
+    case OP_LW: // Load Word
+    default:
+        return raw_word;
+    }
+}
+
+// Returns the fault message for an illegal data access, or NULL.
+const char *mem_access_fault(opcode_t op, control_t ctrl, int addr)
+{
+    if (!ctrl.MemRead && !ctrl.MemWrite)
+        return NULL;
+    if (addr < 0 || addr / 4 >= DMEM_SIZE)
+        return "ADDRESS OUT OF RANGE";
+    if ((op == OP_SH || op == OP_LH || op == OP_LHU) && (addr % 2 != 0))
+        return "MISALIGNED HALF ACCESS";
+    if ((op == OP_SW || op == OP_LW) && (addr % 4 != 0))
+        return "MISALIGNED WORD ACCESS";
+    return NULL;
+}
+
+void store_merge(opcode_t op, int *word, int byte_offset, int val)
+{
+    unsigned char *p = (unsigned char *)word;
+    switch (op)
+    {
+    case OP_SB:
+        p[byte_offset] = val & 0xFF;
+        break;
+    case OP_SH:
+        p[byte_offset] = val & 0xFF;
+        p[byte_offset + 1] = (val >> 8) & 0xFF;
+        break;
+    case OP_SW:
+        *word = val;
+        break;
+    default:
+        break;
+    }
+}
+
+//////////////////////////////////////////////////// FORWARDING UNIT /////////////////////////////////////////////////////////////////////////////////////////////////
+/*
+ * In-flight instructions are addressed by their distance ahead of EX:
+ * 0 is the instruction in EX (ID/EX), 1 the one in the first memory stage
+ * (EX/MEM), 2..mem_stages the later memory stages and mem_stages + 1 the one
+ * in WB (MEM/WB). ALU results can be forwarded from distance 1 on; load data
+ * from distance 1 + load_use_distance() on. A load-use latency longer than
+ * the pipeline keeps tracking a load for retired_depth() cycles after it
+ * has written back (retired_pipe), so its consumers still wait.
+ */
+typedef struct
+{
+    int serial;       // ecall or CSR access: nothing younger may issue
+    int writes, rd;   // register result
+    int load, value;  // value is only meaningful from distance 1 on
+} producer_t;
+
+int load_use_distance()
+{
+    return cfg.load_use < 0 ? cfg.mem_stages : cfg.load_use;
+}
+
+// Cycles a retired load is still tracked: what the load-use latency asks for beyond WB.
+int retired_depth()
+{
+    int n = load_use_distance() - cfg.mem_stages - 1;
+    return n > 0 ? n : 0;
+}
+
+producer_t producer(int dist)
+{
+    producer_t p = {0};
+    int valid, op;
+    control_t c;
+    if (dist == 0)
+    {
+        valid = ID_EX_old.valid, op = ID_EX_old.op, c = ID_EX_old.ctrl, p.rd = ID_EX_old.rd;
+    }
+    else if (dist == 1)
+    {
+        valid = EX_MEM_old.valid, op = EX_MEM_old.op, c = EX_MEM_old.ctrl, p.rd = EX_MEM_old.rd;
+        p.value = c.MemRead ? mem_forward_data : EX_MEM_old.alu; // MEM already ran this cycle
+    }
+    else
+    {
+        const MEM_WB_t *w = dist <= cfg.mem_stages ? &mem_pipe_old[dist - 2]
+                            : dist == cfg.mem_stages + 1 ? &MEM_WB_old
+                                                         : &retired_pipe[dist - cfg.mem_stages - 2];
+        valid = w->valid, op = w->op, c = w->ctrl, p.rd = w->rd;
+        p.value = c.MemToReg ? w->mem_data : w->alu;
+    }
+    p.serial = valid && (op == OP_ECALL || is_csr_op(op));
+    p.writes = valid && c.RegWrite && p.rd != 0;
+    p.load = c.MemRead;
+    return p;
+}
+
+// Value of rs for a consumer reading it this cycle: the youngest producer from distance 1 on, else val.
+int forward_value(int rs, int val)
+{
+    if (rs == 0)
+        return 0;
+    for (int dist = 1; dist <= cfg.mem_stages + 1; dist++)
+    {
+        producer_t p = producer(dist);
+        if (p.writes && p.rd == rs)
+            return p.value;
+    }
+    return val;
+}
+
+/*
+ * Checks whether rs can be forwarded to a consumer that reads it `lag`
+ * cycles from now (1 for EX, 0 for a branch resolved in ID). Returns the
+ * stall reason, or HPM_NONE when the youngest producer of rs will be ready.
+ */
+hpm_event_t operand_hazard(int rs, int lag)
+{
+    if (rs == 0)
+        return HPM_NONE;
+    for (int dist = 0; dist <= cfg.mem_stages + 1 + retired_depth(); dist++)
+    {
+        producer_t p = producer(dist);
+        if (!p.writes || p.rd != rs)
+            continue;
+        if (p.load)
+            return dist + lag < 1 + load_use_distance() ? HPM_LOAD_USE_STALL : HPM_NONE;
+        return dist + lag < 1 ? HPM_BRANCH_STALL : HPM_NONE;
+    }
+    return HPM_NONE;
+}
+
+////////////////////////////////////////////////////////////////// ID STAGE ////////////////////////////////////////////////////////////////////////////////////////////
+
+// Early branch resolution: compares forwarded operands in ID and redirects fetch.
+void resolve_branch_id(const decoded_t *d, control_t c)
+{
+    int a = forward_value(d->rs1, reg_file[d->rs1]);
+    int b = forward_value(d->rs2, reg_file[d->rs2]);
+    if (c.Branch && !branch_taken(d->op, a, b))
+        return;
+
+    pc_next = d->op == OP_JALR ? (a + d->imm) & ~1 : ID_EX_new.pc + d->imm * 4;
+    pc_redirect = 1;
+    flush_fetch();
+    hpm_count(HPM_FLUSH);
+    TRACE("ID  : CONTROL HAZARD | Redirecting PC to %d\n", pc_next);
+}
+
+void ID_stage()
+{
+    // A stalled instruction stays in IF/ID and is re-checked here every cycle.
+    stall = 0;
+    if (!IF_ID.valid)
+    {
+        ID_EX_new.valid = 0;
+        return;
+    }
+
+    ID_EX_new = (ID_EX_t){0};
+    ID_EX_new.valid = 1;
+    ID_EX_new.pc = IF_ID.pc;
+
+    decoded_t d = program_decoded[IF_ID.pc / 4];
+    ID_EX_new.op = d.op;
+    ID_EX_new.rd = d.rd;
+    ID_EX_new.rs1 = d.rs1;
+    ID_EX_new.rs2 = d.rs2;
+    ID_EX_new.imm = d.imm;
+
+    control_t c = control(d.op);
+    int early = cfg.branch_in_id && (c.Branch || c.Jump);
+
+    // Nothing issues behind an ecall or CSR access until it retires.
+    hpm_event_t why = HPM_NONE;
+    for (int dist = 0; dist <= cfg.mem_stages && !why; dist++)
+    {
+        if (producer(dist).serial)
+            why = HPM_SERIALIZE_STALL;
+    }
+    // CSR instructions read rs1 in WB, once everything older has retired.
+    if (!why && !is_csr_op(d.op))
+        why = operand_hazard(d.rs1, !early);
+    if (!why && !is_csr_op(d.op))
+        why = operand_hazard(d.rs2, !early);
+    if (why)
+    {
+        stall = 1;
+        ID_EX_new.valid = 0;
+        hpm_count(why);
+        return;
+    }
+
+    ID_EX_new.ctrl = c;
+
+    if (early)
+        resolve_branch_id(&d, c);
+}
+
+////////////////////////////////////////////////////////////////////////////EX STAGE //////////////////////////////////////////////////////////////////////////////////////////
+void EX_stage()
+{
+    if (!ID_EX_old.valid)
+    {
+        EX_MEM_new.valid = 0;
+        TRACE("EX  : BUBBLE\n");
+        return;
+    }
+
+    EX_MEM_new.valid = 1;
+    EX_MEM_new.pc = ID_EX_old.pc;
+    EX_MEM_new.op = ID_EX_old.op;
+    EX_MEM_new.ctrl = ID_EX_old.ctrl;
+    EX_MEM_new.rd = ID_EX_old.rd;
+
+    // --- FORWARDING LOGIC ---
+    // ID has stalled until every operand is forwardable; see operand_hazard().
+    int a = forward_value(ID_EX_old.rs1, reg_file[ID_EX_old.rs1]);
+    int store_val = forward_value(ID_EX_old.rs2, reg_file[ID_EX_old.rs2]);
+    int b = ID_EX_old.ctrl.ALUSrc ? ID_EX_old.imm : store_val;
+
+    EX_MEM_new.store_val = store_val;
+
+    // --- ALU OPERATIONS ---
+    EX_MEM_new.alu = alu_compute(ID_EX_old.op, a, b, ID_EX_old.imm, ID_EX_old.pc);
+
+    // --- BRANCH AND JUMP HANDLING ---
+    int take_branch = ID_EX_old.ctrl.Branch && branch_taken(ID_EX_old.op, a, b);
+
+    if (!cfg.branch_in_id && (take_branch || ID_EX_old.op == OP_JAL || ID_EX_old.op == OP_JALR))
+    {
+        if (ID_EX_old.op == OP_JALR)
+            pc_next = (a + ID_EX_old.imm) & ~1;
+        else
+            pc_next = ID_EX_old.pc + ID_EX_old.imm * 4;
+
+        pc_redirect = 1;
+
+        flush_fetch();
+        hpm_count(HPM_FLUSH);
+
+        TRACE("EX  : CONTROL HAZARD | Redirecting PC to %d\n", pc_next);
+    }
+
+    // CSR accesses execute in WB; carry the CSR number and rs1/uimm there.
+    if (is_csr_op(ID_EX_old.op))
+    {
+        EX_MEM_new.alu = ID_EX_old.imm;
+        EX_MEM_new.store_val = ID_EX_old.rs1;
+    }
+
+    if (ID_EX_old.op == OP_HALT)
+    {
+        EX_MEM_new.valid = 1;
+        EX_MEM_new.op = OP_HALT;
+        EX_MEM_new.ctrl = (control_t){0};
+        return;
+    }
+
+    TRACE("EX  : ALU=%-5d | EX/MEM : rd=%d alu=%d\n",
+           EX_MEM_new.alu, EX_MEM_new.rd, EX_MEM_new.alu);
+}
+
+////////////////////////////////////////////////////////////////// MEM STAGE //////////////////////////////////////////////////////////////////////////////////////////
+// First memory stage: performs the access. Later stages only delay the result.
+void MEM_stage()
+{
+    MEM_WB_t *out = cfg.mem_stages > 1 ? &mem_pipe_new[0] : &MEM_WB_new;
+    if (!EX_MEM_old.valid)
+    {
+        out->valid = 0;
+        TRACE("MEM : IDLE\n");
+        return;
+    }
+    if (EX_MEM_old.op == OP_HALT)
+    {
+        out->valid = 1;
+        out->pc = EX_MEM_old.pc;
+        out->op = OP_HALT;
+        return;
+    }
+
+    out->valid = 1;
+    out->pc = EX_MEM_old.pc;
+    out->store_val = EX_MEM_old.store_val;
+    out->op = EX_MEM_old.op;
+    out->ctrl = EX_MEM_old.ctrl;
+    out->rd = EX_MEM_old.rd;
+    out->alu = EX_MEM_old.alu;
+
+    int addr = EX_MEM_old.alu;
+    int word_addr = addr / 4;
+    int byte_offset = addr % 4;
+    const char *fault = mem_access_fault(EX_MEM_old.op, EX_MEM_old.ctrl, addr);
+    if (fault)
+    {
+        sim_fault = fault;
+        sim_fault_addr = addr;
+        out->valid = 0;
+        return;
+    }
+
+    // --- MEMORY READ (LOADS) ---
+    if (EX_MEM_old.ctrl.MemRead)
+    {
+        out->mem_data = load_extend(EX_MEM_old.op, data_memory[word_addr], byte_offset);
+        mem_forward_data = out->mem_data;
+        TRACE("MEM : LOAD mem[%d] = %d\n", addr, out->mem_data);
+    }
+
+    // --- MEMORY WRITE (STORES) ---
+    // The ALU result is only an address for memory ops; never index with it otherwise.
+    if (EX_MEM_old.ctrl.MemWrite)
+    {
+        dmem_dirty[word_addr / DMEM_PAGE_WORDS] = 1;
+        if (EX_MEM_old.op == OP_SW)
+        {
+            TRACE("MEM STORE HIT: addr=%d word=%d value=%d\n",
+                  addr, word_addr, EX_MEM_old.store_val);
+        }
+        store_merge(EX_MEM_old.op, &data_memory[word_addr], byte_offset, EX_MEM_old.store_val);
+        if (EX_MEM_old.op == OP_SW)
+            TRACE("AFTER STORE data_memory[25] = %d\n", data_memory[25]);
+    }
+}
+
+void MEM_pipe_stages()
+{
+    for (int i = 0; i < cfg.mem_stages - 1; i++)
+        *(i + 2 < cfg.mem_stages ? &mem_pipe_new[i + 1] : &MEM_WB_new) = mem_pipe_old[i];
+}
+////////////////////////////////////////////////////////////// SYSTEM CALLS //////////////////////////////////////////////////////////////////////////////////////////
+/*
+ * Proxy-kernel style ecall handling: a7 holds the Linux RISC-V syscall number,
+ * a0-a2 the arguments and a0 receives the result. The host services the call
+ * directly against the guest registers and data memory.
+ */
+#define SYS_READ 63
+#define SYS_WRITE 64
+#define SYS_EXIT 93
+#define SYS_CLOCK_GETTIME 113
+#define SYS_GETTIMEOFDAY 169
+#define SYS_BRK 214
+#define ERR_BADF (-9)
+#define ERR_FAULT (-14)
+#define ERR_NOSYS (-38)
+
+SIM_LOCAL int sys_brk = -1;      // program break (-1 = not yet placed)
+SIM_LOCAL int sys_exited = 0, sys_exit_code = 0;
+SIM_LOCAL int sys_echo = 1;      // pass guest writes through to the host
+SIM_LOCAL int syscall_busy = 0;  // cycles left before the pipeline resumes after an ecall
+
+// Forgets the program break and exit status; done whenever a program restarts.
+void syscall_reset()
+{
+    sys_brk = -1;
+    sys_exited = 0;
+    sys_exit_code = 0;
+}
+
+int guest_range_ok(int addr, int len)
+{
+    return addr >= 0 && len >= 0 && addr + len >= addr && addr + len <= DMEM_SIZE * 4;
+}
+
+// Marks the pages of data memory that [addr, addr + len) was stored to; nothing if len is 0.
+void guest_mark_dirty(const int *mem, int addr, int len)
+{
+    if (mem != data_memory || len <= 0)
+        return;
+    for (int p = addr / 4 / DMEM_PAGE_WORDS; p <= (addr + len - 1) / 4 / DMEM_PAGE_WORDS; p++)
+        dmem_dirty[p] = 1;
+}
+
+void guest_put_word(int *mem, int addr, int val)
+{
+    if (!guest_range_ok(addr, 4) || addr % 4)
+        return;
+    mem[addr / 4] = val;
+    guest_mark_dirty(mem, addr, 4);
+}
+
+// Services the ecall described by regs; returns 1 if the program exited.
+int syscall_service(int *regs, int *mem)
+{
+    unsigned char *bytes = (unsigned char *)mem;
+    int a0 = regs[10], a1 = regs[11], a2 = regs[12];
+    long long nsec = (long long)cycle * 1000 / cfg.clock_mhz;
+    int ret = ERR_NOSYS;
+
+    switch (regs[17])
+    {
+    case SYS_EXIT:
+        sys_exited = 1;
+        sys_exit_code = a0;
+        return 1;
+
+    case SYS_WRITE:
+        ret = a0 != 1 && a0 != 2 ? ERR_BADF : ERR_FAULT;
+        if (ret == ERR_FAULT && guest_range_ok(a1, a2))
+        {
+            if (sys_echo)
+                fwrite(bytes + a1, 1, a2, a0 == 1 ? stdout : stderr);
+            ret = a2;
+        }
+        break;
+
+    case SYS_READ:
+        ret = a0 != 0 ? ERR_BADF : ERR_FAULT;
+        if (ret == ERR_FAULT && guest_range_ok(a1, a2))
+        {
+            ret = (int)fread(bytes + a1, 1, a2, stdin);
+            guest_mark_dirty(mem, a1, ret);
+        }
+        break;
+
+    case SYS_BRK:
+        if (sys_brk < 0)
+        {
+            // Start the heap on the page after the highest non-zero word.
+            int top = 0;
+            for (int i = 0; i < DMEM_SIZE; i++)
+                if (mem[i])
+                    top = i + 1;
+            sys_brk = (top + DMEM_PAGE_WORDS - 1) / DMEM_PAGE_WORDS * DMEM_PAGE_WORDS * 4;
+        }
+        if (a0 >= sys_brk && a0 <= DMEM_SIZE * 4)
+            sys_brk = a0;
+        ret = sys_brk;
+        break;
+
+    case SYS_CLOCK_GETTIME: // struct timespec with 32-bit fields
+        ret = ERR_FAULT;
+        if (guest_range_ok(a1, 8) && a1 % 4 == 0)
+        {
+            guest_put_word(mem, a1, (int)(nsec / 1000000000));
+            guest_put_word(mem, a1 + 4, (int)(nsec % 1000000000));
+            ret = 0;
+        }
+        break;
+
+    case SYS_GETTIMEOFDAY: // struct timeval with 32-bit fields
+        ret = ERR_FAULT;
+        if (guest_range_ok(a0, 8) && a0 % 4 == 0)
+        {
+            guest_put_word(mem, a0, (int)(nsec / 1000000000));
+            guest_put_word(mem, a0 + 4, (int)(nsec / 1000 % 1000000));
+            ret = 0;
+        }
+        break;
+    }
+
+    regs[10] = ret;
+    return 0;
+}
+
+////////////////////////////////////////////////////////////// FUNCTIONAL MODEL //////////////////////////////////////////////////////////////////////////////////////
+
+typedef enum
+{
+    FUNC_OK,
+    FUNC_HALT,  // halt reached; the PC stays on it
+    FUNC_END,   // PC is outside the program
+    FUNC_FAULT  // illegal data or CSR access
+} func_status_t;
+
+// Architectural effect of one executed instruction.
+typedef struct
+{
+    int pc;
+    opcode_t op;
+    int rd, value;              // register write (rd == 0: none)
+    int store, addr, store_val; // memory write
+} retire_t;
+
+// Decodes the loaded program once; ID and the functional model read this table.
+void predecode(int instr_count)
+{
+    for (int i = 0; i < instr_count; i++)
+        program_decoded[i] = decode(instruction_memory[i]);
+}
+
+/*
+ * Executes the instruction at *pc_p on the given register file and memory with
+ * no timing: the same datapath helpers as the pipeline, one call per instruction.
+ */
+func_status_t func_step(int instr_count, int *regs, int *mem, int *pc_p, retire_t *r)
+{
+    int cur = *pc_p;
+    if (cur < 0 || cur / 4 >= instr_count)
+        return FUNC_END;
+
+    const decoded_t *d = &program_decoded[cur / 4];
+    control_t c = control(d->op);
+    retire_t rec = {0};
+    rec.pc = cur;
+    rec.op = d->op;
+    if (r)
+        *r = rec;
+    if (d->op == OP_HALT)
+        return FUNC_HALT;
+    if (d->op == OP_ECALL)
+    {
+        if (syscall_service(regs, mem))
+            return FUNC_HALT;
+        *pc_p = cur + 4;
+        return FUNC_OK;
+    }
+    if (is_csr_op(d->op))
+    {
+        if (!csr_execute(d->op, d->rd, d->rs1, d->imm, regs))
+            return FUNC_FAULT;
+        *pc_p = cur + 4;
+        return FUNC_OK;
+    }
+
+    int a = d->rs1 ? regs[d->rs1] : 0;
+    int b = c.ALUSrc ? d->imm : (d->rs2 ? regs[d->rs2] : 0);
+    int result = alu_compute(d->op, a, b, d->imm, cur);
+    int next = cur + 4;
+
+    if (d->op == OP_JALR)
+        next = (a + d->imm) & ~1;
+    else if (d->op == OP_JAL || (c.Branch && branch_taken(d->op, a, b)))
+        next = cur + d->imm * 4;
+
+    if (c.MemRead || c.MemWrite)
+    {
+        int addr = result;
+        if (mem_access_fault(d->op, c, addr))
+            return FUNC_FAULT;
+        if (c.MemRead)
+        {
+            result = load_extend(d->op, mem[addr / 4], addr % 4);
+        }
+        else
+        {
+            int val = d->rs2 ? regs[d->rs2] : 0;
+            store_merge(d->op, &mem[addr / 4], addr % 4, val);
+            rec.store = 1;
+            rec.addr = addr;
+            rec.store_val = val;
+        }
+    }
+
+    if (c.RegWrite && d->rd != 0)
+    {
+        regs[d->rd] = result;
+        rec.rd = d->rd;
+        rec.value = result;
+    }
+
+    *pc_p = next;
+    if (r)
+        *r = rec;
+    return FUNC_OK;
+}
+
+////////////////////////////////////////////////////////////// LOCKSTEP CHECKER //////////////////////////////////////////////////////////////////////////////////////
+/*
+ * With --cosim the functional model keeps its own copy of the architectural
+ * state and executes one instruction each time the pipeline retires one in WB.
+ * The retired PC, the register write and the store (address and stored bytes)
+ * must match; the first mismatch is reported and stops the simulation.
+ */
+SIM_LOCAL int ref_regs[REG_COUNT], ref_mem[DMEM_SIZE], ref_pc, ref_instr_count;
+
+void cosim_begin(int instr_count)
+{
+    memcpy(ref_regs, reg_file, sizeof(ref_regs));
+    memcpy(ref_mem, data_memory, sizeof(ref_mem));
+    ref_pc = -1; // adopt the PC of the first retirement (needed after a restore)
+    ref_instr_count = instr_count;
+}
+
+int store_mask(opcode_t op)
+{
+    return op == OP_SB ? 0xFF : op == OP_SH ? 0xFFFF : -1;
+}
+
+void cosim_retire()
+{
+    const MEM_WB_t *w = &MEM_WB_old;
+    if (ref_pc < 0)
+        ref_pc = w->pc;
+
+    // System calls and CSR accesses are executed once, by the pipeline; the reference adopts their effects.
+    if ((w->op == OP_ECALL || is_csr_op(w->op)) && w->pc == ref_pc)
+    {
+        memcpy(ref_regs, reg_file, sizeof(ref_regs));
+        memcpy(ref_mem, data_memory, sizeof(ref_mem));
+        ref_pc += 4;
+        return;
+    }
+
+    retire_t ref;
+    int ref_at = ref_pc;
+    func_status_t st = func_step(ref_instr_count, ref_regs, ref_mem, &ref_pc, &ref);
+
+    int rd = (w->op != OP_HALT && w->ctrl.RegWrite) ? w->rd : 0;
+    int value = w->ctrl.MemToReg ? w->mem_data : w->alu;
+    int store = w->op != OP_HALT && w->ctrl.MemWrite;
+    int mask = store_mask(w->op);
+
+    char what[96] = "";
+    if (st == FUNC_END || st == FUNC_FAULT)
+        snprintf(what, sizeof(what), "reference %s at pc=%d", st == FUNC_END ? "left the program" : "faulted", ref_at);
+    else if (w->pc != ref_at)
+        snprintf(what, sizeof(what), "retired pc=%d, reference pc=%d", w->pc, ref_at);
+    else if ((w->op == OP_HALT) != (st == FUNC_HALT))
+        snprintf(what, sizeof(what), "halt mismatch");
+    else if (rd != ref.rd || (rd && value != ref.value))
+        snprintf(what, sizeof(what), "pipeline x%d = %d, reference x%d = %d", rd, rd ? value : 0, ref.rd, ref.value);
+    else if (store != ref.store ||
+             (store && (w->alu != ref.addr || (w->store_val & mask) != (ref.store_val & mask))))
+        snprintf(what, sizeof(what), "pipeline mem[%d] <- %d, reference mem[%d] <- %d",
+                 w->alu, w->store_val & mask, ref.addr, ref.store_val & mask);
+
+    if (!what[0])
+        return;
+
+    printf("COSIM: divergence at cycle %d, retired instruction %lld\n", cycle, instret);
+    printf("  pc=%d \"%s\": %s\n", w->pc, w->pc >= 0 && w->pc / 4 < IMEM_SIZE ? instruction_memory[w->pc / 4] : "?", what);
+    sim_fault = "COSIM DIVERGENCE";
+    sim_fault_addr = w->pc;
+}
+
+//////////////////////////////////////////////////////////////// WB STAGE ///////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * An ecall is serviced when it retires, so every older instruction has
+ * already written back; ID holds younger ones until then. The pipeline then
+ * stays frozen for ecall_cost cycles while the host does the work.
+ */
+void retire_ecall()
+{
+    int exited = syscall_service(reg_file, data_memory);
+    TRACE("WB  : ECALL %d -> a0=%d\n", reg_file[17], reg_file[10]);
+    if (cfg.cosim)
+        cosim_retire();
+
+    if (exited)
+    {
+        flush_fetch();
+        halt_fetched = 1;
+        halt_done = 1;
+    }
+    syscall_busy = exited ? 0 : cfg.ecall_cost;
+}
+
+/*
+ * CSR accesses are serialized the same way: they execute at retirement, when
+ * the counters reflect every older instruction, and nothing younger has
+ * issued. minstret counts the CSR instruction before a written value lands,
+ * so a write is exactly what the next instruction reads.
+ */
+void retire_csr()
+{
+    const MEM_WB_t *w = &MEM_WB_old;
+    unsigned long long retired = csr_counter[2] + !(csr_inhibit & 4);
+    int done = csr_execute(w->op, w->rd, w->store_val, w->alu, reg_file);
+    if (!done)
+    {
+        sim_fault = "ILLEGAL CSR ACCESS";
+        sim_fault_addr = w->pc;
+        return;
+    }
+    if (done == 1 || (w->alu & ~0x80) != CSR_MINSTRET)
+        csr_counter[2] = retired;
+    TRACE("WB  : CSR 0x%03X -> x%d=%d\n", w->alu, w->rd, reg_file[w->rd]);
+    if (cfg.cosim)
+        cosim_retire();
+}
+
+void count_retired(const MEM_WB_t *w)
+{
+    csr_counter[2] += !(csr_inhibit & 4);
+    if (w->ctrl.MemRead)
+        hpm_count(HPM_LOAD);
+    if (w->ctrl.MemWrite)
+        hpm_count(HPM_STORE);
+    if (w->ctrl.Branch)
+        hpm_count(HPM_BRANCH);
+}
+
+void WB_stage()
+{
+    if (!MEM_WB_old.valid)
+        return;
+    instret++;
+    if (bbv_interval)
+        bbv_retire(MEM_WB_old.pc);
+    if (is_csr_op(MEM_WB_old.op))
+    {
+        retire_csr();
+        return;
+    }
+    count_retired(&MEM_WB_old);
+    if (MEM_WB_old.op == OP_ECALL)
+    {
+        retire_ecall();
+        return;
+    }
+    if (cfg.cosim)
+        cosim_retire();
+    if (MEM_WB_old.op == OP_HALT)
+    {
+        halt_done = 1;
+        return;
+    }
+    if (MEM_WB_old.ctrl.RegWrite && MEM_WB_old.rd != 0)
+        reg_file[MEM_WB_old.rd] = MEM_WB_old.ctrl.MemToReg ? MEM_WB_old.mem_data : MEM_WB_old.alu;
+}
+
+///////////////////////////////////////////////////////////// PIPELINE DRIVER ///////////////////////////////////////////////////////////////////////////////////////
+
+// Empties every pipeline register and clears stall, redirect and forwarding state.
+void reset_pipeline()
+{
+    stall = 0;
+    pc_redirect = 0;
+    pc_next = 0;
+    mem_forward_data = 0;
+    halt_fetched = 0;
+    halt_done = 0;
+    syscall_busy = 0;
+    sim_fault = NULL;
+    IF_ID = (IF_ID_t){0};
+    memset(fetch_pipe, 0, sizeof(fetch_pipe));
+    memset(mem_pipe_old, 0, sizeof(mem_pipe_old));
+    memset(mem_pipe_new, 0, sizeof(mem_pipe_new));
+    memset(retired_pipe, 0, sizeof(retired_pipe));
+    ID_EX_old = ID_EX_new = (ID_EX_t){0};
+    EX_MEM_old = EX_MEM_new = (EX_MEM_t){0};
+    MEM_WB_old = MEM_WB_new = (MEM_WB_t){0};
+}
+
+// Zeroes registers, memory, counters and pipeline state before a fresh run.
+void reset_state()
+{
+    memset(reg_file, 0, sizeof(reg_file));
+    memset(data_memory, 0, sizeof(data_memory));
+    memset(dmem_dirty, 0, sizeof(dmem_dirty));
+    pc = 0;
+    cycle = 0;
+    instret = 0;
+    reset_pipeline();
+    syscall_reset();
+    csr_reset();
+}
+
+// True once halt has retired (or fetch ran off the program) and all latches are empty.
+int pipeline_drained(int instr_count)
+{
+    int fetch_done = halt_done || (!pc_redirect && (pc < 0 || pc / 4 >= instr_count));
+    int empty = !IF_ID.valid && !ID_EX_old.valid && !EX_MEM_old.valid && !MEM_WB_old.valid;
+    for (int i = 0; i < cfg.fetch_stages - 1; i++)
+        empty = empty && !fetch_pipe[i].valid;
+    for (int i = 0; i < cfg.mem_stages - 1; i++)
+        empty = empty && !mem_pipe_old[i].valid;
+    return fetch_done && empty;
+}
+
+// Outcome of a finished or stopped run; "ran off program" means fetch left the program without a halt.
+const char *run_status(int instr_count)
+{
+    if (sim_fault)
+        return sim_fault;
+    if (!pipeline_drained(instr_count))
+        return "timeout";
+    return halt_done ? "ok" : "ran off program";
+}
+
+void step_cycle(int instr_count)
+{
+    cycle++;
+    csr_counter[0] += !(csr_inhibit & 1);
+    TRACE("\n--- CYCLE %d ---\n", cycle);
+
+    if (syscall_busy)
+    {
+        syscall_busy--;
+        hpm_count(HPM_ECALL_CYCLE);
+        TRACE("SYSCALL: pipeline held\n");
+        return;
+    }
+
+    WB_stage();
+    MEM_pipe_stages();
+    MEM_stage();
+    EX_stage();
+    ID_stage();
+    IF_stage(instr_count);
+
+    ID_EX_old = ID_EX_new;
+    EX_MEM_old = EX_MEM_new;
+    memcpy(mem_pipe_old, mem_pipe_new, (cfg.mem_stages - 1) * sizeof(MEM_WB_t));
+    int depth = retired_depth();
+    if (depth)
+    {
+        memmove(retired_pipe + 1, retired_pipe, (depth - 1) * sizeof(MEM_WB_t));
+        retired_pipe[0] = MEM_WB_old;
+    }
+    MEM_WB_old = MEM_WB_new;
+}
+
+/*
+ * Retires everything that has already left ID and squashes what was only
+ * fetched, so pc is the next instruction to execute and the pipeline is
+ * empty. The architectural state left behind no longer depends on the
+ * pipeline shape, so a different one can carry on from it.
+ */
+void drain_pipeline()
+{
+    int resume = pc_redirect ? pc_next : pc;
+    for (int i = 0; !pc_redirect && i < cfg.fetch_stages - 1; i++)
+    {
+        if (fetch_pipe[i].valid)
+            resume = fetch_pipe[i].pc; // newest first, so this ends on the oldest
+    }
+    if (!pc_redirect && IF_ID.valid)
+        resume = IF_ID.pc;
+
+    flush_fetch();
+    stall = 0;
+    pc_redirect = 0;
+    pc = resume;
+    // No instructions exist for IF, so nothing new enters; a redirect still lands in pc.
+    while (!sim_fault && !pipeline_drained(0))
+        step_cycle(0);
+}
+
+///////////////////////////////////////////////// HELPER FUNCTION /////////////////////////////////////////////////////////////////////////////////////////////
+void load_data_memory(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+    {
+        perror("data.txt open failed");
+        return;
+    }
+
+    int addr = 0, val = 0;
+    while (fscanf(fp, "%d %d", &addr, &val) != EOF)
+    {
+        if (addr >= 0 && addr / 4 < DMEM_SIZE)
+        {
+            data_memory[addr / 4] = val;
+            dmem_dirty[addr / 4 / DMEM_PAGE_WORDS] = 1;
+        }
+    }
+    fclose(fp);
+}
+
+void use_private_program()
+{
+    instruction_memory = program_text;
+    program_decoded = program_table;
+}
+
+// Reads one instruction per line into instruction_memory and decodes it; returns the count or -1.
+int load_program(const char *filename)
+{
+    FILE *ifp = fopen(filename, "r");
+    if (!ifp)
+        return -1;
+
+    use_private_program();
+    int n = 0;
+    while (n < IMEM_SIZE && fgets(instruction_memory[n], MAX_LEN, ifp))
+    {
+        instruction_memory[n][strcspn(instruction_memory[n], "\r\n")] = 0;
+        n++;
+    }
+    fclose(ifp);
+    predecode(n);
+    return n;
+}
+
+unsigned int dirty_pages()
+{
+    unsigned int count = 0;
+    for (int p = 0; p < DMEM_PAGES; p++)
+        count += dmem_dirty[p];
+    return count;
+}
+
+/*
+ * Writes one dump frame holding every page stored to since the previous frame,
+ * then clears the dirty bits. The first frame creates the file; later frames
+ * (from --dump-every) are appended, so replaying the frames in order rebuilds
+ * data memory at each dump point.
+ *
+ * Text frames list the words of each dirty page as "<addr>: <value>": all of
+ * them under --dump-every, so a word stored back to zero is not lost, and
+ * only the non-zero ones in a single end-of-run dump. Binary frames are: u32 cycle, u32 page count, then per page a u32 page index
+ * followed by DMEM_PAGE_WORDS raw words. The binary file starts with the
+ * DUMP_MAGIC tag, a u32 version and the u32 page size in bytes. All fields are
+ * in host byte order.
+ */
+void dump_data_memory(const char *filename)
+{
+    int binary = (cfg.dump_format == DUMP_BINARY);
+    const char *mode = dump_frames ? (binary ? "ab" : "a") : (binary ? "wb" : "w");
+    FILE *fp = fopen(filename, mode);
+    if (!fp)
+    {
+        perror("dump_data_memory fopen failed");
+        return;
+    }
+
+    unsigned int count = dirty_pages();
+
+    if (binary)
+    {
+        if (!dump_frames)
+        {
+            unsigned int header[2] = {DUMP_VERSION, DMEM_PAGE_WORDS * 4};
+            fwrite(DUMP_MAGIC, 1, 4, fp);
+            fwrite(header, sizeof(header[0]), 2, fp);
+        }
+        unsigned int frame[2] = {(unsigned int)cycle, count};
+        fwrite(frame, sizeof(frame[0]), 2, fp);
+    }
+    else if (cfg.dump_every)
+    {
+        fprintf(fp, "# cycle %d\n", cycle);
+    }
+
+    for (int p = 0; p < DMEM_PAGES; p++)
+    {
+        if (!dmem_dirty[p])
+            continue;
+        dmem_dirty[p] = 0;
+
+        if (binary)
+        {
+            unsigned int index = p;
+            fwrite(&index, sizeof(index), 1, fp);
+            fwrite(&data_memory[p * DMEM_PAGE_WORDS], sizeof(int), DMEM_PAGE_WORDS, fp);
+            continue;
+        }
+
+        for (int i = p * DMEM_PAGE_WORDS; i < (p + 1) * DMEM_PAGE_WORDS && i < DMEM_SIZE; i++)
+        {
+            if (data_memory[i] != 0 || cfg.dump_every)
+                fprintf(fp, "%d: %d\n", i * 4, data_memory[i]);
+        }
+    }
+
+    dump_frames++;
+    fclose(fp);
+}
+
+// Builds "<prefix>_<program>.<ext>" from the instruction file path.
+void make_output_name(const char *prefix, const char *inst_file, const char *ext, char *out, size_t size)
+{
+    const char *base = inst_file;
+    for (const char *s = inst_file; *s; s++)
+    {
+        if (*s == '/' || *s == '\\')
+            base = s + 1;
+    }
+
+    char stem[MAX_LEN];
+    snprintf(stem, sizeof(stem), "%s", base);
+    char *dot = strrchr(stem, '.');
+    if (dot && dot != stem)
+        *dot = 0;
+
+    snprintf(out, size, "%s_%s.%s", prefix, stem, ext);
+}
+
+////////////////////////////////////////////////////////////// CHECKPOINTS ///////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Checkpoint layout (host byte order):
+ *   CKPT_MAGIC, u32 version, u32 REG_COUNT, u32 DMEM_SIZE, u32 DMEM_PAGE_WORDS, u32 IMEM_SIZE
+ *   program: u32 name length, name, u32 instruction count, then per line u32 length + text
+ *   scalars: pc, cycle, halt_fetched, halt_done, stall, pc_redirect, pc_next,
+ *            mem_forward_data, syscall_busy, sys_brk, sys_exited, sys_exit_code,
+ *            then i64 instret
+ *   CSRs: csr_counter (32 x u64), csr_event (32 x i32), csr_inhibit
+ *   pipeline shape: fetch_stages, mem_stages, branch_in_id, load_use
+ *   latches: IF_ID, ID_EX old/new, EX_MEM old/new, MEM_WB old/new, then the extra
+ *            fetch and memory stage arrays and retired_pipe (full MAX_* length), all as raw structs
+ *   reg_file, then u32 page count and per non-zero page a u32 index plus its raw words
+ * The latch structs are stored as-is, so CKPT_VERSION must change with their layout.
+ */
+void ckpt_write_u32(FILE *fp, unsigned int v)
+{
+    fwrite(&v, sizeof(v), 1, fp);
+}
+
+unsigned int ckpt_read_u32(FILE *fp)
+{
+    unsigned int v = 0;
+    if (fread(&v, sizeof(v), 1, fp) != 1)
+        v = 0;
+    return v;
+}
+
+void ckpt_write_str(FILE *fp, const char *str)
+{
+    unsigned int len = strlen(str);
+    ckpt_write_u32(fp, len);
+    fwrite(str, 1, len, fp);
+}
+
+int ckpt_read_str(FILE *fp, char *out, size_t size)
+{
+    unsigned int len = ckpt_read_u32(fp);
+    if (len >= size || fread(out, 1, len, fp) != len)
+        return 0;
+    out[len] = 0;
+    return 1;
+}
+
+int save_checkpoint(const char *filename, const char *inst_file, int instr_count)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+    {
+        perror("save_checkpoint fopen failed");
+        return 0;
+    }
+
+    fwrite(CKPT_MAGIC, 1, 4, fp);
+    ckpt_write_u32(fp, CKPT_VERSION);
+    ckpt_write_u32(fp, REG_COUNT);
+    ckpt_write_u32(fp, DMEM_SIZE);
+    ckpt_write_u32(fp, DMEM_PAGE_WORDS);
+    ckpt_write_u32(fp, IMEM_SIZE);
+
+    ckpt_write_str(fp, inst_file);
+    ckpt_write_u32(fp, instr_count);
+    for (int i = 0; i < instr_count; i++)
+        ckpt_write_str(fp, instruction_memory[i]);
+
+    int scalars[] = {pc, cycle, halt_fetched, halt_done, stall, pc_redirect, pc_next,
+                     mem_forward_data, syscall_busy, sys_brk, sys_exited, sys_exit_code};
+    fwrite(scalars, sizeof(scalars), 1, fp);
+    fwrite(&instret, sizeof(instret), 1, fp);
+    fwrite(csr_counter, sizeof(csr_counter), 1, fp);
+    fwrite(csr_event, sizeof(csr_event), 1, fp);
+    fwrite(&csr_inhibit, sizeof(csr_inhibit), 1, fp);
+    int shape[] = {cfg.fetch_stages, cfg.mem_stages, cfg.branch_in_id, cfg.load_use};
+    fwrite(shape, sizeof(shape), 1, fp);
+
+    fwrite(&IF_ID, sizeof(IF_ID), 1, fp);
+    fwrite(&ID_EX_old, sizeof(ID_EX_old), 1, fp);
+    fwrite(&ID_EX_new, sizeof(ID_EX_new), 1, fp);
+    fwrite(&EX_MEM_old, sizeof(EX_MEM_old), 1, fp);
+    fwrite(&EX_MEM_new, sizeof(EX_MEM_new), 1, fp);
+    fwrite(&MEM_WB_old, sizeof(MEM_WB_old), 1, fp);
+    fwrite(&MEM_WB_new, sizeof(MEM_WB_new), 1, fp);
+    fwrite(fetch_pipe, sizeof(fetch_pipe), 1, fp);
+    fwrite(mem_pipe_old, sizeof(mem_pipe_old), 1, fp);
+    fwrite(mem_pipe_new, sizeof(mem_pipe_new), 1, fp);
+    fwrite(retired_pipe, sizeof(retired_pipe), 1, fp);
+    fwrite(reg_file, sizeof(reg_file), 1, fp);
+
+    // Only pages holding non-zero words are stored; restore zero-fills the rest.
+    int used[DMEM_PAGES] = {0};
+    unsigned int pages = 0;
+    for (int i = 0; i < DMEM_SIZE; i++)
+    {
+        if (data_memory[i] && !used[i / DMEM_PAGE_WORDS])
+        {
+            used[i / DMEM_PAGE_WORDS] = 1;
+            pages++;
+        }
+    }
+    ckpt_write_u32(fp, pages);
+    for (int p = 0; p < DMEM_PAGES; p++)
+    {
+        if (!used[p])
+            continue;
+        ckpt_write_u32(fp, p);
+        fwrite(&data_memory[p * DMEM_PAGE_WORDS], sizeof(int), DMEM_PAGE_WORDS, fp);
+    }
+
+    // Buffered writes can still fail when the file is closed.
+    int ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok)
+    {
+        printf("Error: could not write checkpoint %s\n", filename);
+        return 0;
+    }
+    if (ckpt_report)
+        printf("CHECKPOINT: saved cycle %d (pc=%d) to %s\n", cycle, pc, filename);
+    return 1;
+}
+
+/*
+ * Restores the full simulator state and program from a checkpoint. Restored
+ * memory pages are marked dirty so the next dump is complete on its own.
+ * Returns the instruction count, or -1 if the file is missing or incompatible.
+ */
+int restore_checkpoint(const char *filename, char *inst_file, size_t size)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        perror("restore_checkpoint fopen failed");
+        return -1;
+    }
+
+    char magic[4] = {0};
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, CKPT_MAGIC, 4) ||
+        ckpt_read_u32(fp) != CKPT_VERSION ||
+        ckpt_read_u32(fp) != REG_COUNT ||
+        ckpt_read_u32(fp) != DMEM_SIZE ||
+        ckpt_read_u32(fp) != DMEM_PAGE_WORDS ||
+        ckpt_read_u32(fp) != IMEM_SIZE)
+    {
+        printf("Error: %s is not a compatible checkpoint\n", filename);
+        fclose(fp);
+        return -1;
+    }
+
+    int ok = ckpt_read_str(fp, inst_file, size);
+    int instr_count = ckpt_read_u32(fp);
+    if (instr_count > IMEM_SIZE)
+        ok = 0;
+    use_private_program();
+    for (int i = 0; ok && i < instr_count; i++)
+        ok = ckpt_read_str(fp, instruction_memory[i], MAX_LEN);
+    if (ok)
+        predecode(instr_count);
+
+    int scalars[12];
+    ok = ok && fread(scalars, sizeof(scalars), 1, fp) == 1;
+    ok = ok && fread(&instret, sizeof(instret), 1, fp) == 1;
+    ok = ok && fread(csr_counter, sizeof(csr_counter), 1, fp) == 1;
+    ok = ok && fread(csr_event, sizeof(csr_event), 1, fp) == 1;
+    ok = ok && fread(&csr_inhibit, sizeof(csr_inhibit), 1, fp) == 1;
+
+    // The pipeline shape is part of the state; it overrides the command line.
+    int shape[4];
+    ok = ok && fread(shape, sizeof(shape), 1, fp) == 1;
+    ok = ok && shape[0] >= 1 && shape[0] <= MAX_FETCH_STAGES && shape[1] >= 1 && shape[1] <= MAX_MEM_STAGES &&
+         shape[3] >= -1 && shape[3] <= MAX_LOAD_USE;
+    if (ok)
+    {
+        cfg.fetch_stages = shape[0];
+        cfg.mem_stages = shape[1];
+        cfg.branch_in_id = shape[2];
+        cfg.load_use = shape[3];
+    }
+    pc = scalars[0];
+    cycle = scalars[1];
+    halt_fetched = scalars[2];
+    halt_done = scalars[3];
+    stall = scalars[4];
+    pc_redirect = scalars[5];
+    pc_next = scalars[6];
+    mem_forward_data = scalars[7];
+    syscall_busy = scalars[8];
+    sys_brk = scalars[9];
+    sys_exited = scalars[10];
+    sys_exit_code = scalars[11];
+
+    ok = ok && fread(&IF_ID, sizeof(IF_ID), 1, fp) == 1;
+    ok = ok && fread(&ID_EX_old, sizeof(ID_EX_old), 1, fp) == 1;
+    ok = ok && fread(&ID_EX_new, sizeof(ID_EX_new), 1, fp) == 1;
+    ok = ok && fread(&EX_MEM_old, sizeof(EX_MEM_old), 1, fp) == 1;
+    ok = ok && fread(&EX_MEM_new, sizeof(EX_MEM_new), 1, fp) == 1;
+    ok = ok && fread(&MEM_WB_old, sizeof(MEM_WB_old), 1, fp) == 1;
+    ok = ok && fread(&MEM_WB_new, sizeof(MEM_WB_new), 1, fp) == 1;
+    ok = ok && fread(fetch_pipe, sizeof(fetch_pipe), 1, fp) == 1;
+    ok = ok && fread(mem_pipe_old, sizeof(mem_pipe_old), 1, fp) == 1;
+    ok = ok && fread(mem_pipe_new, sizeof(mem_pipe_new), 1, fp) == 1;
+    ok = ok && fread(retired_pipe, sizeof(retired_pipe), 1, fp) == 1;
+    ok = ok && fread(reg_file, sizeof(reg_file), 1, fp) == 1;
+
+    memset(data_memory, 0, sizeof(data_memory));
+    memset(dmem_dirty, 0, sizeof(dmem_dirty));
+    unsigned int pages = ok ? ckpt_read_u32(fp) : 0;
+    for (unsigned int i = 0; ok && i < pages; i++)
+    {
+        unsigned int p = ckpt_read_u32(fp);
+        ok = p < DMEM_PAGES &&
+             fread(&data_memory[p * DMEM_PAGE_WORDS], sizeof(int), DMEM_PAGE_WORDS, fp) == DMEM_PAGE_WORDS;
+        if (ok)
+            dmem_dirty[p] = 1;
+    }
+    fclose(fp);
+
+    if (!ok)
+    {
+        printf("Error: %s is truncated or corrupt\n", filename);
+        return -1;
+    }
+    if (ckpt_report)
+        printf("CHECKPOINT: restored cycle %d (pc=%d) from %s\n", cycle, pc, filename);
+    return instr_count;
+}
+
+/*
+ * Starts the lockstep checker on a restored pipeline. With several memory
+ * stages a younger store may already have written memory while an older load
+ * is still in flight, and the reference would re-run that load against the
+ * new value. Draining first leaves only retired effects in the state the
+ * reference copies.
+ */
+void cosim_begin_restored(int instr_count)
+{
+    cfg.cosim = 0;
+    drain_pipeline();
+    cfg.cosim = 1;
+    cosim_begin(instr_count);
+}
+
+////////////////////////////////////////////////////////////// SIMPOINT SAMPLING /////////////////////////////////////////////////////////////////////////////////////
+
+// Euclidean k-means over the projected BBVs, seeded k-means++ style.
+void kmeans(const double *points, int n, int k, int *assign, double *centroids)
+{
+    unsigned int seed = 0xC1057E5;
+    double *dist = malloc(n * sizeof(double));
+
+    memcpy(centroids, &points[(xorshift32(&seed) % n) * BBV_DIMS], BBV_DIMS * sizeof(double));
+    for (int c = 1; c < k; c++)
+    {
+        double total = 0;
+        for (int i = 0; i < n; i++)
+        {
+            dist[i] = 1e300;
+            for (int j = 0; j < c; j++)
+            {
+                double d2 = 0;
+                for (int d = 0; d < BBV_DIMS; d++)
+                {
+                    double diff = points[i * BBV_DIMS + d] - centroids[j * BBV_DIMS + d];
+                    d2 += diff * diff;
+                }
+                if (d2 < dist[i])
+                    dist[i] = d2;
+            }
+            total += dist[i];
+        }
+
+        int pick = 0;
+        double target = total * (xorshift32(&seed) / 4294967296.0);
+        while (pick < n - 1 && (target -= dist[pick]) > 0)
+            pick++;
+        memcpy(&centroids[c * BBV_DIMS], &points[pick * BBV_DIMS], BBV_DIMS * sizeof(double));
+    }
+    free(dist);
+
+    for (int i = 0; i < n; i++)
+        assign[i] = -1;
+
+    for (int iter = 0; iter < KMEANS_ITERS; iter++)
+    {
+        int changed = 0;
+        for (int i = 0; i < n; i++)
+        {
+            int best = 0;
+            double best_d2 = 1e300;
+            for (int c = 0; c < k; c++)
+            {
+                double d2 = 0;
+                for (int d = 0; d < BBV_DIMS; d++)
+                {
+                    double diff = points[i * BBV_DIMS + d] - centroids[c * BBV_DIMS + d];
+                    d2 += diff * diff;
+                }
+                if (d2 < best_d2)
+                {
+                    best_d2 = d2;
+                    best = c;
+                }
+            }
+            if (assign[i] != best)
+            {
+                assign[i] = best;
+                changed = 1;
+            }
+        }
+        if (!changed)
+            break;
+
+        for (int c = 0; c < k; c++)
+        {
+            int members = 0;
+            double sum[BBV_DIMS] = {0};
+            for (int i = 0; i < n; i++)
+            {
+                if (assign[i] != c)
+                    continue;
+                members++;
+                for (int d = 0; d < BBV_DIMS; d++)
+                    sum[d] += points[i * BBV_DIMS + d];
+            }
+            for (int d = 0; members && d < BBV_DIMS; d++)
+                centroids[c * BBV_DIMS + d] = sum[d] / members;
+        }
+    }
+}
+
+/*
+ * Fast-forwards functionally from the initial state to `start - warmup`, then
+ * runs the pipeline until `length` more instructions retire after the warm-up.
+ * Returns the CPI of the measured part (0 if nothing retired in it).
+ */
+double simulate_interval(const int *init_mem, int instr_count, long long start, long long length, long long warmup)
+{
+    memset(reg_file, 0, sizeof(reg_file));
+    memcpy(data_memory, init_mem, sizeof(data_memory));
+    pc = 0;
+    syscall_reset();
+    csr_reset();
+    if (warmup > start)
+        warmup = start;
+    for (long long i = 0; i < start - warmup; i++)
+    {
+        if (func_step(instr_count, reg_file, data_memory, &pc, NULL) != FUNC_OK)
+            break;
+    }
+
+    reset_pipeline();
+    cycle = 0;
+    instret = 0;
+    if (cfg.cosim)
+        cosim_begin(instr_count);
+    int begin = warmup ? -1 : 0;
+    while (!sim_fault && !pipeline_drained(instr_count) && instret < warmup + length &&
+           (!cfg.max_cycles || cycle < cfg.max_cycles))
+    {
+        step_cycle(instr_count);
+        if (begin < 0 && instret >= warmup)
+            begin = cycle;
+    }
+
+    long long retired = instret - warmup;
+    return (begin < 0 || retired <= 0) ? 0 : (cycle - begin) / (double)retired;
+}
+
+/*
+ * SimPoint-style sampled simulation: profile BBVs with the functional model,
+ * cluster the intervals, simulate one representative per cluster in detail and
+ * weight their CPIs by cluster size. The next-closest interval of each cluster
+ * is simulated too; the weighted CPI gap between the two is reported as the
+ * representative spread. It only hints at how well each representative stands
+ * for its cluster: single-interval clusters add nothing and it is not a bound.
+ */
+int run_simpoint(int instr_count)
+{
+    int init_mem[DMEM_SIZE];
+    memcpy(init_mem, data_memory, sizeof(init_mem));
+    sys_echo = 0;
+
+    // 1. Profile
+    int interval = cfg.bbv_interval ? cfg.bbv_interval : 1000;
+    bbv_begin(interval, NULL);
+    pc = 0;
+    long long total = 0;
+    func_status_t st = FUNC_OK;
+    while (st == FUNC_OK && total < cfg.max_instrs)
+    {
+        int fetch_pc = pc;
+        st = func_step(instr_count, reg_file, data_memory, &pc, NULL);
+        if (st == FUNC_OK || st == FUNC_HALT)
+        {
+            bbv_retire(fetch_pc);
+            total++;
+        }
+    }
+    bbv_end();
+    if (st == FUNC_FAULT)
+        printf("SIMPOINT: functional model faulted at pc=%d, profiling stops there\n", pc);
+    if (!bbv_count)
+    {
+        printf("SIMPOINT: no instructions executed\n");
+        bbv_free();
+        return 1;
+    }
+
+    // 2. Cluster
+    int k = cfg.simpoint_k < bbv_count ? cfg.simpoint_k : bbv_count;
+    int *assign = malloc(bbv_count * sizeof(int));
+    double *centroids = malloc(k * BBV_DIMS * sizeof(double));
+    kmeans(bbv_points, bbv_count, k, assign, centroids);
+    printf("SIMPOINT: %lld instructions in %d intervals of %d, %d clusters\n", total, bbv_count, interval, k);
+
+    // 3. Simulate the representatives
+    trace = 0;
+    double est_cpi = 0, spread = 0;
+    long long detailed = 0;
+    for (int c = 0; c < k; c++)
+    {
+        int rep = -1, alt = -1;
+        double rep_d2 = 1e300, alt_d2 = 1e300;
+        long long weight = 0;
+        for (int i = 0; i < bbv_count; i++)
+        {
+            if (assign[i] != c)
+                continue;
+            weight += bbv_lengths[i];
+            double d2 = 0;
+            for (int d = 0; d < BBV_DIMS; d++)
+            {
+                double diff = bbv_points[i * BBV_DIMS + d] - centroids[c * BBV_DIMS + d];
+                d2 += diff * diff;
+            }
+            if (d2 < rep_d2)
+            {
+                alt = rep;
+                alt_d2 = rep_d2;
+                rep = i;
+                rep_d2 = d2;
+            }
+            else if (d2 < alt_d2)
+            {
+                alt = i;
+                alt_d2 = d2;
+            }
+        }
+        if (rep < 0)
+            continue;
+
+        double w = weight / (double)total;
+        double cpi = simulate_interval(init_mem, instr_count, (long long)rep * interval, bbv_lengths[rep], cfg.simpoint_warmup);
+        detailed += bbv_lengths[rep];
+        est_cpi += w * cpi;
+
+        printf("  cluster %d: interval %d weight %.3f CPI %.4f", c, rep, w, cpi);
+        if (alt >= 0)
+        {
+            double alt_cpi = simulate_interval(init_mem, instr_count, (long long)alt * interval, bbv_lengths[alt], cfg.simpoint_warmup);
+            detailed += bbv_lengths[alt];
+            spread += w * (cpi > alt_cpi ? cpi - alt_cpi : alt_cpi - cpi);
+            printf(" (check interval %d CPI %.4f)", alt, alt_cpi);
+        }
+        printf("\n");
+    }
+    free(assign);
+    free(centroids);
+    bbv_free();
+
+    printf("SIMPOINT: estimated CPI %.4f, estimated cycles %.0f\n", est_cpi, est_cpi * total);
+    printf("SIMPOINT: representative spread %.2f%% (weighted CPI gap to the next-closest interval)\n",
+           est_cpi ? 100.0 * spread / est_cpi : 0.0);
+    printf("SIMPOINT: detailed simulation of %lld of %lld instructions (%.1f%%)\n",
+           detailed, total, 100.0 * detailed / total);
+
+    // 4. Optionally compare against the full detailed run
+    if (cfg.simpoint_verify)
+    {
+        double cpi = simulate_interval(init_mem, instr_count, 0, total, 0);
+        printf("SIMPOINT: full detailed run %d cycles, CPI %.4f, actual error %.2f%%\n",
+               cycle, cpi, cpi ? 100.0 * (est_cpi - cpi) / cpi : 0.0);
+    }
+    return 0;
+}
+
+int parse_option(const char *arg)
+{
+    if (!strcmp(arg, "--dump-format=text"))
+        cfg.dump_format = DUMP_TEXT;
+    else if (!strcmp(arg, "--dump-format=bin"))
+        cfg.dump_format = DUMP_BINARY;
+    else if (!strncmp(arg, "--dump-every=", 13))
+        cfg.dump_every = atoi(arg + 13);
+    else if (!strncmp(arg, "--save-at-cycle=", 16))
+        cfg.save_at_cycle = atoi(arg + 16);
+    else if (!strncmp(arg, "--save-at-pc=", 13))
+        cfg.save_at_pc = atoi(arg + 13);
+    else if (!strncmp(arg, "--checkpoint=", 13))
+        cfg.checkpoint_file = arg + 13;
+    else if (!strncmp(arg, "--restore=", 10))
+        cfg.restore_file = arg + 10;
+    else if (!strncmp(arg, "--max-cycles=", 13))
+        cfg.max_cycles = atoi(arg + 13);
+    else if (!strncmp(arg, "--max-instrs=", 13))
+        cfg.max_instrs = atoll(arg + 13);
+    else if (!strncmp(arg, "--bbv-interval=", 15))
+        cfg.bbv_interval = atoi(arg + 15);
+    else if (!strncmp(arg, "--simpoint=", 11))
+        cfg.simpoint_k = atoi(arg + 11);
+    else if (!strncmp(arg, "--simpoint-warmup=", 18))
+        cfg.simpoint_warmup = atoi(arg + 18);
+    else if (!strcmp(arg, "--simpoint-verify"))
+        cfg.simpoint_verify = 1;
+    else if (!strcmp(arg, "--quiet"))
+        trace = 0;
+    else if (!strcmp(arg, "--cosim"))
+        cfg.cosim = 1;
+    else if (!strncmp(arg, "--ecall-cost=", 13))
+        cfg.ecall_cost = atoi(arg + 13);
+    else if (!strncmp(arg, "--clock-mhz=", 12) && atoi(arg + 12) > 0)
+        cfg.clock_mhz = atoi(arg + 12);
+    else if (!strncmp(arg, "--fetch-stages=", 15) && atoi(arg + 15) >= 1 && atoi(arg + 15) <= MAX_FETCH_STAGES)
+        cfg.fetch_stages = atoi(arg + 15);
+    else if (!strncmp(arg, "--mem-stages=", 13) && atoi(arg + 13) >= 1 && atoi(arg + 13) <= MAX_MEM_STAGES)
+        cfg.mem_stages = atoi(arg + 13);
+    else if (!strcmp(arg, "--branch-stage=id"))
+        cfg.branch_in_id = 1;
+    else if (!strcmp(arg, "--branch-stage=ex"))
+        cfg.branch_in_id = 0;
+    else if (!strncmp(arg, "--load-use=", 11) && atoi(arg + 11) >= 0 && atoi(arg + 11) <= MAX_LOAD_USE)
+        cfg.load_use = atoi(arg + 11);
+    else
+        return 0;
+    return 1;
+}
+
+////////////////////////////////////////////////////////////// REGRESSION RUNNER /////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+    char name[MAX_LEN];
+    char options[PATH_LEN];
+} regress_variant_t;
+
+typedef struct
+{
+    char program[PATH_LEN];
+    regress_variant_t variant;       // empty name: the command-line configuration as is
+    char result[REGRESS_RESULT_LEN]; // final state in golden-file format
+    char diff[REGRESS_RESULT_LEN];   // "- expected" / "+ actual" lines on mismatch
+    int has_golden, passed;
+    double ms;
+} regress_test_t;
+
+typedef struct
+{
+    regress_test_t *tests;
+    int count, next, update;
+    sim_config_t cfg;
+    pthread_mutex_t lock;
+} regress_pool_t;
+
+// Thread count for `work` items: jobs, or one per CPU when jobs <= 0.
+int worker_count(int jobs, int work)
+{
+    if (jobs <= 0)
+    {
+#ifdef _SC_NPROCESSORS_ONLN
+        jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (jobs <= 0)
+            jobs = 4;
+    }
+    if (jobs > work)
+        jobs = work ? work : 1;
+    return jobs;
+}
 
-        pc_redirect = 1;
+double now_ms()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
 
-        IF_ID.valid = 0; // flush IF
+/*
+ * Reads dir/VARIANTS_FILE: one "<name> <option>..." line per variant, '#'
+ * starts a comment. Each program in that directory is also run once per
+ * variant, with the options on top of the command line.
+ */
+int read_variants(const char *dir, regress_variant_t *variants)
+{
+    char path[PATH_LEN + 32], line[PATH_LEN + MAX_LEN];
+    snprintf(path, sizeof(path), "%s/%s", dir, VARIANTS_FILE);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
 
-        printf("EX  : CONTROL HAZARD | Redirecting PC to %d\n", pc_next);
+    int n = 0;
+    while (n < REGRESS_MAX_VARIANTS && fgets(line, sizeof(line), fp))
+    {
+        line[strcspn(line, "#\r\n")] = 0;
+        regress_variant_t *v = &variants[n];
+        int used = 0;
+        if (sscanf(line, "%63s %n", v->name, &used) != 1)
+            continue;
+        snprintf(v->options, sizeof(v->options), "%s", line + used);
+        n++;
     }
+    fclose(fp);
+    return n;
+}
 
-    if (ID_EX_old.op == OP_HALT)
+// Collects every *.txt program below dir (golden files use GOLDEN_EXT), plus its variants if asked.
+int find_programs(const char *dir, regress_test_t *tests, int count, int with_variants)
+{
+    DIR *dp = opendir(dir);
+    if (!dp)
+        return count;
+
+    regress_variant_t variants[REGRESS_MAX_VARIANTS];
+    int variant_count = with_variants ? read_variants(dir, variants) : 0;
+
+    struct dirent *de;
+    while ((de = readdir(dp)) && count < REGRESS_MAX_TESTS)
     {
-        EX_MEM_new.valid = 1;
-        EX_MEM_new.op = OP_HALT;
-        EX_MEM_new.ctrl = (control_t){0};
-        return;
+        if (de->d_name[0] == '.')
+            continue;
+
+        char path[PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        DIR *sub = opendir(path);
+        if (sub)
+        {
+            closedir(sub);
+            count = find_programs(path, tests, count, with_variants);
+            continue;
+        }
+
+        size_t len = strlen(de->d_name);
+        if (len <= 4 || strcmp(de->d_name + len - 4, ".txt"))
+            continue;
+        for (int v = -1; v < variant_count && count < REGRESS_MAX_TESTS; v++)
+        {
+            memset(&tests[count], 0, sizeof(tests[count]));
+            snprintf(tests[count].program, sizeof(tests[count].program), "%s", path);
+            if (v >= 0)
+                tests[count].variant = variants[v];
+            count++;
+        }
     }
+    closedir(dp);
+    return count;
+}
 
-    printf("EX  : ALU=%-5d | EX/MEM : rd=%d alu=%d\n",
-           EX_MEM_new.alu, EX_MEM_new.rd, EX_MEM_new.alu);
+int compare_programs(const void *a, const void *b)
+{
+    const regress_test_t *x = a, *y = b;
+    int c = strcmp(x->program, y->program);
+    return c ? c : strcmp(x->variant.name, y->variant.name);
 }
 
-////////////////////////////////////////////////////////////////// MEM STAGE //////////////////////////////////////////////////////////////////////////////////////////
-void MEM_stage()
+// <program>.golden, or <program>.<variant>.golden for a variant run.
+void golden_name(const regress_test_t *t, char *out, size_t size)
 {
-    if (!EX_MEM_old.valid)
-    {
-        MEM_WB_new.valid = 0;
-        printf("MEM : IDLE\n");
-        return;
-    }
-    if (EX_MEM_old.op == OP_HALT)
+    snprintf(out, size, "%.*s%s%s%s", (int)(strlen(t->program) - 4), t->program,
+             t->variant.name[0] ? "." : "", t->variant.name, GOLDEN_EXT);
+}
+
+// Appends the lines of `a` that do not appear in `b`, each prefixed with `mark`.
+void diff_lines(const char *a, const char *b, char mark, char *out, size_t size)
+{
+    while (*a)
     {
-        MEM_WB_new.valid = 1;
-        MEM_WB_new.op = OP_HALT;
-        return;
+        const char *end = strchr(a, '\n');
+        size_t len = end ? (size_t)(end - a) : strlen(a);
+
+        int found = 0;
+        for (const char *l = b; *l && !found;)
+        {
+            const char *lend = strchr(l, '\n');
+            size_t llen = lend ? (size_t)(lend - l) : strlen(l);
+            found = (llen == len && !strncmp(l, a, len));
+            l += llen + (lend != NULL);
+        }
+
+        size_t used = strlen(out);
+        if (!found && used < size)
+            snprintf(out + used, size - used, "        %c %.*s\n", mark, (int)len, a);
+        a += len + (end != NULL);
     }
+}
+
+/*
+ * A variant with --save-at-cycle checks the checkpoint round trip: the run is
+ * saved to a temporary file at that cycle, restored from it and carries on.
+ */
+int regress_round_trip(const char *program, int instr_count)
+{
+    char name[] = "/tmp/rvckptXXXXXX", restored[PATH_LEN];
+    int fd = mkstemp(name);
+    if (fd < 0)
+        return 0;
+    close(fd);
+    int ok = save_checkpoint(name, program, instr_count) &&
+             restore_checkpoint(name, restored, sizeof(restored)) == instr_count;
+    remove(name);
+    if (ok && cfg.cosim)
+        cosim_begin_restored(instr_count);
+    return ok;
+}
 
-    MEM_WB_new.valid = 1;
-    MEM_WB_new.op = EX_MEM_old.op;
-    MEM_WB_new.ctrl = EX_MEM_old.ctrl;
-    MEM_WB_new.rd = EX_MEM_old.rd;
-    MEM_WB_new.alu = EX_MEM_old.alu;
+void run_regress_test(regress_test_t *t, int update)
+{
+    double start = now_ms();
 
-    int addr = EX_MEM_old.alu;
-    int word_addr = addr / 4;
-    int byte_offset = addr % 4;
-    if ((EX_MEM_old.op == OP_SH || EX_MEM_old.op == OP_LH || EX_MEM_old.op == OP_LHU) &&
-        (addr % 2 != 0))
+    char options[PATH_LEN], *save = NULL;
+    int options_ok = 1;
+    snprintf(options, sizeof(options), "%s", t->variant.options);
+    for (char *o = strtok_r(options, " \t", &save); o; o = strtok_r(NULL, " \t", &save))
+        options_ok = options_ok && parse_option(o);
+
+    reset_state();
+    load_data_memory("data.txt");
+    int n = options_ok ? load_program(t->program) : -1;
+    if (cfg.cosim && n >= 0)
+        cosim_begin(n);
+    int limit = cfg.max_cycles ? cfg.max_cycles : REGRESS_MAX_CYCLES;
+    while (n >= 0 && !sim_fault && !pipeline_drained(n) && cycle < limit)
     {
-        printf("MISALIGNED HALF ACCESS at %d\n", addr);
-        exit(1);
+        step_cycle(n);
+        if (cycle == cfg.save_at_cycle && !regress_round_trip(t->program, n))
+            sim_fault = "CHECKPOINT ROUND TRIP FAILED";
     }
 
-    if ((EX_MEM_old.op == OP_SW || EX_MEM_old.op == OP_LW) &&
-        (addr % 4 != 0))
+    const char *status = !options_ok ? "bad variant options" : n < 0 ? "unreadable" : run_status(n);
+    int len = snprintf(t->result, sizeof(t->result), "status %s\ncycles %d\ninstret %lld\n", status, cycle, instret);
+    if (sys_exited)
+        len += snprintf(t->result + len, sizeof(t->result) - len, "exit %d\n", sys_exit_code);
+    for (int i = 1; i < REG_COUNT; i++)
+    {
+        if (reg_file[i] != 0)
+            len += snprintf(t->result + len, sizeof(t->result) - len, "x%d %d\n", i, reg_file[i]);
+    }
+    for (int i = 0; i < DMEM_SIZE && len < (int)sizeof(t->result); i++)
     {
-        printf("MISALIGNED WORD ACCESS at %d\n", addr);
-        exit(1);
+        if (data_memory[i] != 0)
+            len += snprintf(t->result + len, sizeof(t->result) - len, "mem %d %d\n", i * 4, data_memory[i]);
     }
+    t->ms = now_ms() - start;
 
-    // --- MEMORY READ (LOADS) ---
-    if (EX_MEM_old.ctrl.MemRead)
+    char golden[PATH_LEN + 8], expected[REGRESS_RESULT_LEN] = "";
+    golden_name(t, golden, sizeof(golden));
+    FILE *fp = fopen(golden, "r");
+    if (fp)
     {
-        int raw_word = data_memory[word_addr];
+        size_t got = fread(expected, 1, sizeof(expected) - 1, fp);
+        expected[got] = 0;
+        fclose(fp);
+        t->has_golden = 1;
+    }
 
-        switch (EX_MEM_old.op)
+    if (update)
+    {
+        fp = fopen(golden, "w");
+        if (fp)
         {
-        case OP_LB: // Load Byte (Signed)
-            MEM_WB_new.mem_data = (signed char)((raw_word >> (byte_offset * 8)) & 0xFF);
-            break;
-        case OP_LBU: // Load Byte (Unsigned)
-            MEM_WB_new.mem_data = (unsigned char)((raw_word >> (byte_offset * 8)) & 0xFF);
-            break;
-        case OP_LH: // Load Half (Signed)
-            MEM_WB_new.mem_data = (signed short)((raw_word >> (byte_offset * 8)) & 0xFFFF);
-            break;
-        case OP_LHU: // Load Half (Unsigned)
-            MEM_WB_new.mem_data = (unsigned short)((raw_word >> (byte_offset * 8)) & 0xFFFF);
-            break;
-        case OP_LW: // Load Word
-        default:
-            MEM_WB_new.mem_data = raw_word;
-            break;
+            fputs(t->result, fp);
+            fclose(fp);
         }
-        printf("MEM : LOAD mem[%d] = %d\n", addr, MEM_WB_new.mem_data);
     }
-    if (EX_MEM_old.ctrl.MemRead)
+
+    t->passed = t->has_golden && !strcmp(expected, t->result);
+    if (t->has_golden && !t->passed)
     {
-        mem_forward_valid = 1;
-        mem_forward_rd = EX_MEM_old.rd;
-        mem_forward_data = MEM_WB_new.mem_data;
+        diff_lines(expected, t->result, '-', t->diff, sizeof(t->diff));
+        diff_lines(t->result, expected, '+', t->diff, sizeof(t->diff));
     }
-    else
+}
+
+void *regress_worker(void *arg)
+{
+    regress_pool_t *pool = arg;
+    sys_echo = 0;
+
+    for (;;)
     {
-        mem_forward_valid = 0;
+        pthread_mutex_lock(&pool->lock);
+        int i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->count)
+            break;
+        cfg = pool->cfg;
+        trace = 0;
+        ckpt_report = 0;
+        run_regress_test(&pool->tests[i], pool->update);
+    }
+    return NULL;
+}
+
+/*
+ * Runs every program below dir on a pool of threads and compares the final
+ * status, cycle count, registers and non-zero memory against the program's
+ * golden file. --regress-update (re)writes the golden files instead.
+ * Returns 0 only if every program matched its golden file.
+ */
+int run_regression(const char *dir, int jobs, int update)
+{
+    regress_test_t *tests = malloc(REGRESS_MAX_TESTS * sizeof(regress_test_t));
+    int count = find_programs(dir, tests, 0, 1);
+    qsort(tests, count, sizeof(tests[0]), compare_programs);
+    jobs = worker_count(jobs, count);
+
+    regress_pool_t pool = {.tests = tests, .count = count, .update = update, .cfg = cfg};
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+
+    printf("REGRESS: %d programs under %s, %d threads\n", count, dir, jobs);
+    double start = now_ms();
+    for (int i = 0; i < jobs; i++)
+        pthread_create(&threads[i], NULL, regress_worker, &pool);
+    for (int i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = now_ms() - start;
+    pthread_mutex_destroy(&pool.lock);
+    free(threads);
+
+    int passed = 0, failed = 0, missing = 0;
+    for (int i = 0; i < count; i++)
+    {
+        regress_test_t *t = &tests[i];
+        const char *verdict = update ? "WROTE" : !t->has_golden ? "NEW " : t->passed ? "PASS" : "FAIL";
+        int cycles = 0;
+        sscanf(strchr(t->result, '\n') + 1, "cycles %d", &cycles);
+        printf("  %s  %s%s%s%s  (%d cycles, %.2f ms)\n", verdict, t->program, t->variant.name[0] ? " [" : "",
+               t->variant.name, t->variant.name[0] ? "]" : "", cycles, t->ms);
+        if (!update && t->has_golden && !t->passed)
+            printf("%s", t->diff);
+
+        if (t->passed)
+            passed++;
+        else if (!t->has_golden)
+            missing++;
+        else
+            failed++;
     }
+    free(tests);
+
+    if (update)
+        printf("REGRESS: wrote %d golden files in %.2f ms\n", count, elapsed);
+    else
+        printf("REGRESS: %d passed, %d failed, %d without golden in %.2f ms\n", passed, failed, missing, elapsed);
+    return (update || (!failed && !missing)) ? 0 : 1;
+}
+
+/////////////////////////////////////////////////////////// DESIGN SPACE SWEEP ///////////////////////////////////////////////////////////////////////////////////
+/*
+ * Runs every workload under every point of a parameter grid. The grid names
+ * simulator options (without "--") and their values, e.g.
+ *     mem-stages=1,2,3;branch-stage=ex,id
+ * either inline or one parameter per line in a file. Each program is loaded
+ * and decoded once; all workers read that copy. Runs are handed out to a
+ * thread pool and the results are written as CSV and JSON, with the Pareto
+ * front of pipeline depth against CPI.
+ */
+typedef struct
+{
+    char name[MAX_LEN];
+    char values[SWEEP_MAX_VALUES][MAX_LEN];
+    int count;
+} sweep_param_t;
+
+typedef struct
+{
+    char name[PATH_LEN];
+    int count;
+    char text[IMEM_SIZE][MAX_LEN];
+    decoded_t decoded[IMEM_SIZE];
+} sweep_program_t;
+
+typedef struct
+{
+    int config, workload;
+    const char *status;
+    int cycles;
+    long long instret;
+    unsigned long long events[HPM_EVENT_COUNT];
+} sweep_run_t;
+
+typedef struct
+{
+    int depth, valid, pareto;
+    long long cycles, instret;
+    double cpi;
+} sweep_summary_t;
 
-    switch (EX_MEM_old.op)
+typedef struct
+{
+    sweep_param_t params[SWEEP_MAX_PARAMS];
+    int param_count;
+    sweep_program_t *programs;
+    int program_count;
+    int init_mem[DMEM_SIZE];
+    // With --restore every run starts from the drained checkpoint instead of reset.
+    int restored, start_regs[REG_COUNT], start_pc, start_halt_done;
+    int start_brk, start_exited, start_exit_code, start_csr_event[32], start_csr_inhibit;
+    unsigned long long start_csr_counter[32];
+    sweep_run_t *runs;
+    int run_count, next;
+    sim_config_t cfg;
+    pthread_mutex_t lock;
+} sweep_t;
+
+// Sets cfg to the base configuration plus grid point `config`.
+void apply_sweep_config(const sweep_t *sw, int config)
+{
+    cfg = sw->cfg;
+    for (int i = 0; i < sw->param_count; i++)
     {
+        const sweep_param_t *p = &sw->params[i];
+        char opt[MAX_LEN * 2 + 4];
+        snprintf(opt, sizeof(opt), "--%s=%s", p->name, p->values[config % p->count]);
+        config /= p->count;
+        parse_option(opt);
+    }
+}
 
-    case OP_SB:
+int sweep_config_count(const sweep_t *sw)
+{
+    int n = 1;
+    for (int i = 0; i < sw->param_count; i++)
+        n *= sw->params[i].count;
+    return n;
+}
+
+// Adds one "name=v1,v2,..." grid entry.
+int add_sweep_param(sweep_t *sw, char *entry)
+{
+    entry += strspn(entry, " \t");
+    if (!strncmp(entry, "--", 2))
+        entry += 2;
+    entry[strcspn(entry, "\r\n#")] = 0;
+    if (!*entry)
+        return 1;
+
+    char *eq = strchr(entry, '=');
+    if (!eq || eq == entry || sw->param_count == SWEEP_MAX_PARAMS)
+        return 0;
+    sweep_param_t *p = &sw->params[sw->param_count++];
+    snprintf(p->name, sizeof(p->name), "%.*s", (int)(eq - entry), entry);
+    p->count = 0;
+    for (char *v = strtok(eq + 1, ", \t"); v && p->count < SWEEP_MAX_VALUES; v = strtok(NULL, ", \t"))
+        snprintf(p->values[p->count++], MAX_LEN, "%s", v);
+    return p->count > 0;
+}
+
+// Reads the grid from a file if `spec` names one, otherwise parses it as ';'-separated entries.
+int parse_sweep_grid(sweep_t *sw, const char *spec)
+{
+    char line[SWEEP_MAX_VALUES * MAX_LEN];
+    FILE *fp = fopen(spec, "r");
+    if (fp)
     {
-        unsigned char *p = (unsigned char *)&data_memory[word_addr];
-        p[byte_offset] = EX_MEM_old.store_val & 0xFF;
-        break;
+        int ok = 1;
+        while (ok && fgets(line, sizeof(line), fp))
+            ok = add_sweep_param(sw, line);
+        fclose(fp);
+        return ok;
     }
 
-    case OP_SH:
+    snprintf(line, sizeof(line), "%s", spec);
+    for (char *entry = line, *end; entry; entry = end)
     {
-        unsigned char *p = (unsigned char *)&data_memory[word_addr];
-        p[byte_offset] = EX_MEM_old.store_val & 0xFF;
-        p[byte_offset + 1] = (EX_MEM_old.store_val >> 8) & 0xFF;
-        break;
+        end = strchr(entry, ';');
+        if (end)
+            *end++ = 0;
+        if (!add_sweep_param(sw, entry))
+            return 0;
     }
+    return 1;
+}
 
-    case OP_SW:
-        printf("MEM STORE HIT: addr=%d word=%d value=%d\n",
-               addr, word_addr, EX_MEM_old.store_val);
-        data_memory[word_addr] = EX_MEM_old.store_val;
-        printf("AFTER STORE data_memory[25] = %d\n", data_memory[25]);
-        break;
+void run_sweep_job(sweep_t *sw, sweep_run_t *r)
+{
+    const sweep_program_t *prog = &sw->programs[r->workload];
+    apply_sweep_config(sw, r->config);
+    reset_state();
+    memcpy(data_memory, sw->init_mem, sizeof(data_memory));
+    instruction_memory = (char (*)[MAX_LEN])prog->text;
+    program_decoded = (decoded_t *)prog->decoded;
+    if (sw->restored)
+    {
+        memcpy(reg_file, sw->start_regs, sizeof(reg_file));
+        pc = sw->start_pc;
+        halt_done = sw->start_halt_done;
+        sys_brk = sw->start_brk;
+        sys_exited = sw->start_exited;
+        sys_exit_code = sw->start_exit_code;
+        memcpy(csr_counter, sw->start_csr_counter, sizeof(csr_counter));
+        memcpy(csr_event, sw->start_csr_event, sizeof(csr_event));
+        csr_inhibit = sw->start_csr_inhibit;
+    }
+
+    if (cfg.cosim)
+        cosim_begin(prog->count);
+    int limit = cfg.max_cycles ? cfg.max_cycles : SWEEP_MAX_CYCLES;
+    while (!sim_fault && !pipeline_drained(prog->count) && cycle < limit)
+        step_cycle(prog->count);
+
+    r->status = run_status(prog->count);
+    r->cycles = cycle;
+    r->instret = instret;
+    memcpy(r->events, hpm_totals, sizeof(r->events));
+}
+
+void *sweep_worker(void *arg)
+{
+    sweep_t *sw = arg;
+    trace = 0;
+    sys_echo = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&sw->lock);
+        int i = sw->next++;
+        pthread_mutex_unlock(&sw->lock);
+        if (i >= sw->run_count)
+            break;
+        run_sweep_job(sw, &sw->runs[i]);
     }
+    return NULL;
 }
-//////////////////////////////////////////////////////////////// WB STAGE ///////////////////////////////////////////////////////////////////////////////////////////
 
-void WB_stage()
+void json_string(FILE *fp, const char *str)
 {
-    if (!MEM_WB_old.valid)
-        return;
-    if (MEM_WB_old.op == OP_HALT)
+    fputc('"', fp);
+    for (; *str; str++)
     {
-        halt_done = 1;
-        return;
+        if (*str == '"' || *str == '\\')
+            fprintf(fp, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(fp, "\\u%04x", *str);
+        else
+            fputc(*str, fp);
     }
-    if (MEM_WB_old.ctrl.RegWrite && MEM_WB_old.rd != 0)
-        reg_file[MEM_WB_old.rd] = MEM_WB_old.ctrl.MemToReg ? MEM_WB_old.mem_data : MEM_WB_old.alu;
+    fputc('"', fp);
 }
 
-///////////////////////////////////////////////// HELPER FUNCTION /////////////////////////////////////////////////////////////////////////////////////////////
-void load_data_memory(const char *filename)
+void write_sweep_csv(const char *filename, const sweep_t *sw, const sweep_summary_t *sum)
 {
-    FILE *fp = fopen(filename, "r");
+    FILE *fp = fopen(filename, "w");
     if (!fp)
     {
-        perror("data.txt open failed");
+        perror("write_sweep_csv fopen failed");
         return;
     }
 
-    int addr = 0, val = 0;
-    while (fscanf(fp, "%d %d", &addr, &val) != EOF)
+    fprintf(fp, "config");
+    for (int i = 0; i < sw->param_count; i++)
+        fprintf(fp, ",%s", sw->params[i].name);
+    fprintf(fp, ",depth,workload,status,cycles,instret,ipc");
+    for (int e = 1; e < HPM_EVENT_COUNT; e++)
+        fprintf(fp, ",%s", hpm_event_names[e]);
+    fprintf(fp, ",config_cpi,pareto\n");
+
+    for (int i = 0; i < sw->run_count; i++)
     {
-        if (addr / 4 < DMEM_SIZE)
-            data_memory[addr / 4] = val;
+        const sweep_run_t *r = &sw->runs[i];
+        const sweep_summary_t *c = &sum[r->config];
+        fprintf(fp, "%d", r->config);
+        for (int p = 0, idx = r->config; p < sw->param_count; idx /= sw->params[p].count, p++)
+            fprintf(fp, ",%s", sw->params[p].values[idx % sw->params[p].count]);
+        fprintf(fp, ",%d,\"%s\",%s,%d,%lld,%.4f", c->depth, sw->programs[r->workload].name, r->status,
+                r->cycles, r->instret, r->cycles ? (double)r->instret / r->cycles : 0);
+        for (int e = 1; e < HPM_EVENT_COUNT; e++)
+            fprintf(fp, ",%llu", r->events[e]);
+        fprintf(fp, ",%.4f,%d\n", c->cpi, c->pareto);
     }
     fclose(fp);
 }
 
-void dump_data_memory(const char *filename)
+void write_sweep_json(const char *filename, const sweep_t *sw, const sweep_summary_t *sum, int configs)
 {
     FILE *fp = fopen(filename, "w");
     if (!fp)
     {
-        perror("dump_data_memory fopen failed");
+        perror("write_sweep_json fopen failed");
         return;
     }
 
-    for (int i = 0; i < DMEM_SIZE; i++)
+    fprintf(fp, "{\n  \"configs\": [");
+    for (int c = 0; c < configs; c++)
     {
-        if (data_memory[i] != 0)
-            fprintf(fp, "%d: %d\n", i * 4, data_memory[i]);
+        fprintf(fp, "%s\n    {\"id\": %d, \"params\": {", c ? "," : "", c);
+        for (int p = 0, idx = c; p < sw->param_count; idx /= sw->params[p].count, p++)
+        {
+            fprintf(fp, "%s", p ? ", " : "");
+            json_string(fp, sw->params[p].name);
+            fprintf(fp, ": ");
+            json_string(fp, sw->params[p].values[idx % sw->params[p].count]);
+        }
+        fprintf(fp, "},\n     \"depth\": %d, \"cycles\": %lld, \"instret\": %lld, \"cpi\": %.4f, \"valid\": %s, \"pareto\": %s,\n     \"runs\": [",
+                sum[c].depth, sum[c].cycles, sum[c].instret, sum[c].cpi,
+                sum[c].valid ? "true" : "false", sum[c].pareto ? "true" : "false");
+        for (int w = 0; w < sw->program_count; w++)
+        {
+            const sweep_run_t *r = &sw->runs[c * sw->program_count + w];
+            fprintf(fp, "%s\n       {\"workload\": ", w ? "," : "");
+            json_string(fp, sw->programs[w].name);
+            fprintf(fp, ", \"status\": ");
+            json_string(fp, r->status);
+            fprintf(fp, ", \"cycles\": %d, \"instret\": %lld, \"ipc\": %.4f", r->cycles, r->instret,
+                    r->cycles ? (double)r->instret / r->cycles : 0);
+            for (int e = 1; e < HPM_EVENT_COUNT; e++)
+                fprintf(fp, ", \"%s\": %llu", hpm_event_names[e], r->events[e]);
+            fprintf(fp, "}");
+        }
+        fprintf(fp, "]}");
     }
-
+    fprintf(fp, "\n  ]\n}\n");
     fclose(fp);
 }
 
+// Options a sweep run cannot honour, or NULL.
+const char *sweep_conflict(const sim_config_t *c, const sim_config_t *base)
+{
+    if (c->simpoint_k)
+        return "--simpoint";
+    if (c->bbv_interval)
+        return "--bbv-interval";
+    if (c->dump_every || c->dump_format != DUMP_TEXT)
+        return "--dump-every/--dump-format";
+    if (c->save_at_cycle >= 0 || c->save_at_pc >= 0 || c->checkpoint_file)
+        return "--save-at-cycle/--save-at-pc/--checkpoint";
+    if (c->restore_file != base->restore_file)
+        return "--restore as a sweep parameter";
+    return NULL;
+}
+
+// Loads the --restore checkpoint as the only workload and drains it into the runs' start state.
+int load_sweep_checkpoint(sweep_t *sw)
+{
+    char name[PATH_LEN];
+    reset_state();
+    int n = restore_checkpoint(cfg.restore_file, name, sizeof(name));
+    if (n < 0)
+        return 0;
+    trace = 0;
+    cfg.cosim = 0; // the checker starts with each run, from the drained state
+    drain_pipeline();
+    if (sim_fault)
+    {
+        printf("Error: %s while draining %s\n", sim_fault, cfg.restore_file);
+        return 0;
+    }
+
+    sweep_program_t *prog = &sw->programs[0];
+    snprintf(prog->name, sizeof(prog->name), "%s", name);
+    prog->count = n;
+    memcpy(prog->text, instruction_memory, sizeof(prog->text));
+    memcpy(prog->decoded, program_decoded, sizeof(prog->decoded));
+    memcpy(sw->init_mem, data_memory, sizeof(sw->init_mem));
+    memcpy(sw->start_regs, reg_file, sizeof(sw->start_regs));
+    sw->start_pc = pc;
+    sw->start_halt_done = halt_done;
+    sw->start_brk = sys_brk;
+    sw->start_exited = sys_exited;
+    sw->start_exit_code = sys_exit_code;
+    memcpy(sw->start_csr_counter, csr_counter, sizeof(sw->start_csr_counter));
+    memcpy(sw->start_csr_event, csr_event, sizeof(sw->start_csr_event));
+    sw->start_csr_inhibit = csr_inhibit;
+    sw->restored = 1;
+    printf("SWEEP: starting every run at pc=%d from %s (drained at cycle %d)\n", pc, cfg.restore_file, cycle);
+    return 1;
+}
+
+/*
+ * workloads are program files or directories searched for *.txt programs.
+ * Returns 1 on a bad grid, an unreadable program or any run that did not
+ * finish cleanly.
+ */
+int run_sweep(const char *grid, char **workloads, int workload_count, const char *out, int jobs)
+{
+    const char *conflict = sweep_conflict(&cfg, &cfg);
+    if (conflict)
+    {
+        printf("Error: %s cannot be combined with --sweep\n", conflict);
+        return 1;
+    }
+    if (cfg.restore_file && workload_count)
+    {
+        printf("Error: --restore supplies the sweep program; do not name workloads as well\n");
+        return 1;
+    }
+
+    sweep_t *sw = calloc(1, sizeof(sweep_t));
+    sw->cfg = cfg;
+    if (!parse_sweep_grid(sw, grid))
+    {
+        printf("Error: bad sweep grid %s\n", grid);
+        free(sw);
+        return 1;
+    }
+    for (int i = 0; i < sw->param_count; i++)
+    {
+        for (int v = 0; v < sw->params[i].count; v++)
+        {
+            char opt[MAX_LEN * 2 + 4];
+            snprintf(opt, sizeof(opt), "--%s=%s", sw->params[i].name, sw->params[i].values[v]);
+            cfg = sw->cfg;
+            int known = parse_option(opt);
+            conflict = known ? sweep_conflict(&cfg, &sw->cfg) : NULL;
+            if (!known || conflict)
+            {
+                if (conflict)
+                    printf("Error: %s cannot be combined with --sweep\n", conflict);
+                else
+                    printf("Error: Unknown sweep option %s\n", opt);
+                cfg = sw->cfg;
+                free(sw);
+                return 1;
+            }
+        }
+    }
+    cfg = sw->cfg;
+    int configs = sweep_config_count(sw);
+
+    // Load and decode each workload once.
+    regress_test_t *found = malloc(REGRESS_MAX_TESTS * sizeof(regress_test_t));
+    int count = 0;
+    for (int i = 0; i < workload_count; i++)
+    {
+        DIR *dp = opendir(workloads[i]);
+        if (dp)
+        {
+            closedir(dp);
+            int first = count;
+            count = find_programs(workloads[i], found, count, 0);
+            qsort(found + first, count - first, sizeof(found[0]), compare_programs);
+        }
+        else if (count < REGRESS_MAX_TESTS)
+        {
+            snprintf(found[count++].program, PATH_LEN, "%s", workloads[i]);
+        }
+    }
+
+    reset_state();
+    load_data_memory("data.txt");
+    memcpy(sw->init_mem, data_memory, sizeof(sw->init_mem));
+    sw->programs = malloc((count ? count : 1) * sizeof(sweep_program_t));
+    int ok = count > 0;
+    if (cfg.restore_file)
+    {
+        ok = load_sweep_checkpoint(sw);
+        count = ok;
+        cfg = sw->cfg; // the checkpoint's pipeline shape only applied while draining
+    }
+    int loaded = 0;
+    for (int i = 0; i < count && ok && !sw->restored; i++)
+    {
+        sweep_program_t *prog = &sw->programs[loaded];
+        snprintf(prog->name, sizeof(prog->name), "%s", found[i].program);
+        prog->count = load_program(prog->name);
+        if (prog->count < 0)
+        {
+            printf("Error: Could not open %s\n", prog->name);
+            ok = 0;
+            break;
+        }
+        // An empty program can only run off its end; it would fail every configuration.
+        if (!prog->count)
+        {
+            printf("SWEEP: skipping %s (no instructions)\n", prog->name);
+            continue;
+        }
+        memcpy(prog->text, instruction_memory, sizeof(prog->text));
+        memcpy(prog->decoded, program_decoded, sizeof(prog->decoded));
+        loaded++;
+    }
+    free(found);
+    if (!sw->restored)
+        count = loaded;
+    if (!ok || !count)
+    {
+        if (!count && !cfg.restore_file)
+            printf("Error: no sweep workloads found\n");
+        free(sw->programs);
+        free(sw);
+        return 1;
+    }
+    sw->program_count = count;
+
+    // Run every (configuration, workload) pair; runs are ordered by configuration.
+    sw->run_count = configs * count;
+    sw->runs = calloc(sw->run_count, sizeof(sweep_run_t));
+    for (int i = 0; i < sw->run_count; i++)
+    {
+        sw->runs[i].config = i / count;
+        sw->runs[i].workload = i % count;
+    }
+    jobs = worker_count(jobs, sw->run_count);
+    printf("SWEEP: %d configurations x %d workloads = %d runs, %d threads\n", configs, count, sw->run_count, jobs);
+
+    pthread_mutex_init(&sw->lock, NULL);
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    double start = now_ms();
+    for (int i = 0; i < jobs; i++)
+        pthread_create(&threads[i], NULL, sweep_worker, sw);
+    for (int i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = now_ms() - start;
+    pthread_mutex_destroy(&sw->lock);
+    free(threads);
+
+    // Aggregate per configuration and mark the depth/CPI Pareto front.
+    sweep_summary_t *sum = calloc(configs, sizeof(sweep_summary_t));
+    int failed = 0;
+    for (int c = 0; c < configs; c++)
+    {
+        apply_sweep_config(sw, c);
+        sum[c].depth = cfg.fetch_stages + cfg.mem_stages + 3;
+        sum[c].valid = 1;
+        for (int w = 0; w < count; w++)
+        {
+            const sweep_run_t *r = &sw->runs[c * count + w];
+            sum[c].cycles += r->cycles;
+            sum[c].instret += r->instret;
+            if (strcmp(r->status, "ok"))
+            {
+                sum[c].valid = 0;
+                failed++;
+            }
+        }
+        sum[c].cpi = sum[c].instret ? (double)sum[c].cycles / sum[c].instret : 0;
+    }
+    cfg = sw->cfg;
+    for (int c = 0; c < configs; c++)
+    {
+        sum[c].pareto = sum[c].valid;
+        for (int o = 0; o < configs && sum[c].pareto; o++)
+        {
+            if (sum[o].valid && sum[o].cpi <= sum[c].cpi && sum[o].depth >= sum[c].depth &&
+                (sum[o].cpi < sum[c].cpi || sum[o].depth > sum[c].depth))
+                sum[c].pareto = 0;
+        }
+    }
+
+    for (int c = 0; c < configs; c++)
+    {
+        printf("  %s cfg %-4d depth %-2d cycles %-10lld CPI %.4f ", sum[c].pareto ? "*" : sum[c].valid ? " " : "!",
+               c, sum[c].depth, sum[c].cycles, sum[c].cpi);
+        for (int p = 0, idx = c; p < sw->param_count; idx /= sw->params[p].count, p++)
+            printf(" %s=%s", sw->params[p].name, sw->params[p].values[idx % sw->params[p].count]);
+        printf("\n");
+    }
+
+    char csv_name[PATH_LEN], json_name[PATH_LEN];
+    snprintf(csv_name, sizeof(csv_name), "%s.csv", out);
+    snprintf(json_name, sizeof(json_name), "%s.json", out);
+    write_sweep_csv(csv_name, sw, sum);
+    write_sweep_json(json_name, sw, sum, configs);
+    printf("SWEEP: %d runs in %.2f ms, %d did not finish; * = Pareto front (depth vs CPI), ! = failed run\n",
+           sw->run_count, elapsed, failed);
+    printf("SWEEP: results written to %s and %s\n", csv_name, json_name);
+
+    free(sum);
+    free(sw->runs);
+    free(sw->programs);
+    free(sw);
+    return failed ? 1 : 0;
+}
+
 ////////////////////////////////////////////////////////////// MAIN FUNCTION /////////////////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char *argv[])
 {
     printf("DEBUG: argc=%d, argv[0]=%s, argv[1]=%s\n", argc, argv[0], (argc > 1 ? argv[1] : "NONE"));
     // Determine which file to open
-    char *inst_file = (argc > 1) ? argv[1] : "instructions.txt";
+    char *inst_file = "instructions.txt";
+    const char *regress_dir = NULL, *sweep_grid = NULL, *sweep_out = "sweep";
+    int regress_jobs = 0, regress_update = 0, workload_count = 0;
+    char **workloads = malloc(argc * sizeof(char *));
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--", 2))
+            inst_file = workloads[workload_count++] = argv[i];
+        else if (!strcmp(argv[i], "--regress"))
+            regress_dir = "Test cases";
+        else if (!strncmp(argv[i], "--regress=", 10))
+            regress_dir = argv[i] + 10;
+        else if (!strcmp(argv[i], "--regress-update"))
+            regress_update = 1;
+        else if (!strncmp(argv[i], "--jobs=", 7))
+            regress_jobs = atoi(argv[i] + 7);
+        else if (!strncmp(argv[i], "--sweep=", 8))
+            sweep_grid = argv[i] + 8;
+        else if (!strncmp(argv[i], "--sweep-out=", 12))
+            sweep_out = argv[i] + 12;
+        else if (!parse_option(argv[i]))
+        {
+            printf("Error: Unknown option %s\n", argv[i]);
+            free(workloads);
+            return 1;
+        }
+    }
+
+    if (regress_dir)
+    {
+        free(workloads);
+        return run_regression(regress_dir, regress_jobs, regress_update);
+    }
+    if (sweep_grid)
+    {
+        if (!workload_count && !cfg.restore_file)
+            workloads[workload_count++] = "Test cases";
+        int rc = run_sweep(sweep_grid, workloads, workload_count, sweep_out, regress_jobs);
+        free(workloads);
+        return rc;
+    }
+    free(workloads);
 
     // 1. Initialize Architectural State
     memset(reg_file, 0, sizeof(reg_file));
+    memset(dmem_dirty, 0, sizeof(dmem_dirty));
     pc = 0;
     cycle = 0;
-    halt_fetched = 0;
-    halt_done = 0;
+    instret = 0;
     // Clear pipeline latches
-    IF_ID = (IF_ID_t){0};
-    ID_EX_old = ID_EX_new = (ID_EX_t){0};
-    EX_MEM_old = EX_MEM_new = (EX_MEM_t){0};
-    MEM_WB_old = MEM_WB_new = (MEM_WB_t){0};
-
-    // 2. Load Data Memory (Always loads from data.txt)
-    load_data_memory("data.txt");
+    reset_pipeline();
 
-    // 3. Load Instruction Memory (from the specified file)
-    FILE *ifp = fopen(inst_file, "r");
-    if (!ifp)
+    int n = 0;
+    char restored_file[MAX_LEN * 2];
+    if (cfg.restore_file)
     {
-        printf("Error: Could not open %s\n", inst_file);
-        return 1;
+        // 2-3. Restore memory, program and pipeline state from a checkpoint
+        n = restore_checkpoint(cfg.restore_file, restored_file, sizeof(restored_file));
+        if (n < 0)
+            return 1;
+        inst_file = restored_file;
     }
-    int n = 0;
-    while (n < IMEM_SIZE && fgets(instruction_memory[n], MAX_LEN, ifp))
+    else
     {
-        instruction_memory[n][strcspn(instruction_memory[n], "\r\n")] = 0;
-        n++;
+        // 2. Load Data Memory (Always loads from data.txt)
+        load_data_memory("data.txt");
+
+        // 3. Load Instruction Memory (from the specified file)
+        n = load_program(inst_file);
+        if (n < 0)
+        {
+            printf("Error: Could not open %s\n", inst_file);
+            return 1;
+        }
+        printf("--- Loaded %d instructions from %s ---\n", n, inst_file);
     }
-    fclose(ifp);
-    printf("--- Loaded %d instructions from %s ---\n", n, inst_file);
+
+    char dump_name[MAX_LEN * 2], ckpt_name[MAX_LEN * 2];
+    make_output_name("dump", inst_file, cfg.dump_format == DUMP_BINARY ? "bin" : "txt", dump_name, sizeof(dump_name));
+    if (cfg.checkpoint_file)
+        snprintf(ckpt_name, sizeof(ckpt_name), "%s", cfg.checkpoint_file);
+    else
+        make_output_name("ckpt", inst_file, "bin", ckpt_name, sizeof(ckpt_name));
+    int checkpoint_saved = 0, checkpoint_failed = 0;
+
+    if (cfg.simpoint_k > 0)
+        return run_simpoint(n);
+
+    if (cfg.bbv_interval)
+    {
+        char bbv_name[MAX_LEN * 2];
+        make_output_name("bbv", inst_file, "bb", bbv_name, sizeof(bbv_name));
+        bbv_begin(cfg.bbv_interval, fopen(bbv_name, "w"));
+    }
+
+    if (cfg.cosim && cfg.restore_file)
+        cosim_begin_restored(n);
+    else if (cfg.cosim)
+        cosim_begin(n);
 
     // 4. Simulation Loop
-    while (!(halt_done && !IF_ID.valid && !ID_EX_old.valid && !EX_MEM_old.valid && !MEM_WB_old.valid))
+    while (!sim_fault && !pipeline_drained(n) && (!cfg.max_cycles || cycle < cfg.max_cycles))
     {
-        cycle++;
-        printf("\n--- CYCLE %d ---\n", cycle);
+        step_cycle(n);
 
-        WB_stage();
-        MEM_stage();
-        EX_stage();
-        ID_stage();
-        IF_stage(n);
+        if (cfg.dump_every && cycle % cfg.dump_every == 0)
+            dump_data_memory(dump_name);
+
+        if (!checkpoint_saved &&
+            (cycle == cfg.save_at_cycle ||
+             (cfg.save_at_pc >= 0 && last_fetched()->valid && last_fetched()->pc == cfg.save_at_pc)))
+        {
+            checkpoint_failed = !save_checkpoint(ckpt_name, inst_file, n);
+            checkpoint_saved = 1;
+        }
+    }
+    if (cfg.bbv_interval)
+    {
+        bbv_end();
+        bbv_free();
+    }
 
-        ID_EX_old = ID_EX_new;
-        EX_MEM_old = EX_MEM_new;
-        MEM_WB_old = MEM_WB_new;
+    if (sim_fault)
+    {
+        printf("%s at %d\n", sim_fault, sim_fault_addr);
+        return 1;
     }
+
     // 5. Final Report
     printf("\nTEST RESULT for %s:\n", inst_file);
     printf("Total Cycles: %d\n", cycle);
+    const char *status = run_status(n);
+    if (!strcmp(status, "ran off program"))
+        printf("Note: fetch ran off the end of the program without a halt\n");
+    else if (!strcmp(status, "timeout"))
+        printf("Note: stopped by --max-cycles=%d before the program finished\n", cfg.max_cycles);
+    if (sys_exited)
+        printf("Exit Code: %d\n", sys_exit_code);
     for (int i = 1; i < REG_COUNT; i++)
     {
         if (reg_file[i] != 0)
             printf("  x%d = %d\n", i, reg_file[i]);
     }
 
-    char dump_name[MAX_LEN];
-    strcpy(dump_name, "dump.txt");
-    dump_data_memory(dump_name);
-    return 0;
+    // Nothing stored since the last --dump-every frame: it already holds the final state.
+    if (!dump_frames || dirty_pages())
+        dump_data_memory(dump_name);
+    return checkpoint_failed ? 1 : 0;
 }